@@ -0,0 +1,118 @@
+/*
+ * Run xdgmenu() in-process and report the median and p99 latency of every
+ * stage, as measured by -T, the peak RSS and the accounted memory.
+ * Usage: bench ITERATIONS [xdg-xmenu options]
+ * The menu is dumped to /dev/null, so pass -d. The first iteration is a
+ * warm-up, it also fills the caches unless -C is given.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../xdg-xmenu.h"
+
+#define MAX_STAGES 32
+
+extern void (*timing_hook)(const char *stage, int64_t wall_ns, int64_t cpu_ns);
+
+struct Stage {
+	const char *name;
+	int64_t *samples;
+	int count;
+} stages[MAX_STAGES];
+int stage_count, iterations, recording;
+
+int cmp_int64(const void *p1, const void *p2)
+{
+	int64_t a = *(const int64_t *)p1, b = *(const int64_t *)p2;
+
+	return (a > b) - (a < b);
+}
+
+void record(const char *name, int64_t wall_ns, int64_t cpu_ns)
+{
+	int i;
+
+	if (!recording)
+		return;
+	for (i = 0; i < stage_count; i++)
+		if (strcmp(stages[i].name, name) == 0)
+			break;
+	if (i == stage_count) {
+		if (stage_count == MAX_STAGES)
+			return;
+		stages[i].name = strdup(name);
+		stages[i].samples = calloc(iterations, sizeof(int64_t));
+		stage_count++;
+	}
+	if (stages[i].count < iterations)
+		stages[i].samples[stages[i].count++] = wall_ns;
+}
+
+void report()
+{
+	struct Stage *stage;
+	struct rusage usage;
+	xdgmenu_memory memory;
+
+	printf("%-16s %6s %12s %12s\n", "stage", "runs", "median ms", "p99 ms");
+	for (int i = 0; i < stage_count; i++) {
+		stage = &stages[i];
+		qsort(stage->samples, stage->count, sizeof(int64_t), cmp_int64);
+		printf("%-16s %6d %12.3f %12.3f\n", stage->name, stage->count,
+				stage->samples[stage->count / 2] / 1e6,
+				stage->samples[(stage->count * 99) / 100] / 1e6);
+	}
+	getrusage(RUSAGE_SELF, &usage);
+	printf("peak RSS: %ld kB\n", usage.ru_maxrss);
+	xdgmenu_memory_stats(&memory);
+	printf("peak accounted: %zu kB, leaked: %zu bytes\n",
+			memory.peak_total / 1024, memory.leaked);
+}
+
+int main(int argc, char *argv[])
+{
+	int fd_stdout, fd_null;
+	char **args;
+	struct timespec start, end;
+
+	if (argc < 2 || (iterations = atoi(argv[1])) <= 0) {
+		fprintf(stderr, "usage: %s ITERATIONS [xdg-xmenu options]\n", argv[0]);
+		return 1;
+	}
+
+	/* xdgmenu gets "xdg-xmenu -T <options>" */
+	args = calloc(argc + 1, sizeof(char *));
+	args[0] = "xdg-xmenu";
+	args[1] = "-T";
+	for (int i = 2; i < argc; i++)
+		args[i] = argv[i];
+	timing_hook = record;
+
+	/* keep the menu off the report */
+	fd_stdout = dup(STDOUT_FILENO);
+	fd_null = open("/dev/null", O_WRONLY);
+	dup2(fd_null, STDOUT_FILENO);
+	for (int i = 0; i <= iterations; i++) {
+		recording = i > 0;
+		optind = 1;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		xdgmenu(argc, args);
+		fflush(stdout);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		record("total", (end.tv_sec - start.tv_sec) * 1000000000LL
+				+ end.tv_nsec - start.tv_nsec, -1);
+	}
+	dup2(fd_stdout, STDOUT_FILENO);
+	close(fd_null);
+
+	report();
+	free(args);
+	return 0;
+}
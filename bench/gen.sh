@@ -0,0 +1,95 @@
+#!/bin/sh
+# Generate a synthetic XDG data dir for the benchmark: usage gen.sh DIR COUNT
+# - COUNT desktop entries in DIR/applications, every 10th one a symlink
+# - the icon theme "bench" with 60 subdirectories, inheriting hicolor
+# - 50 directories for a long PATH, written to DIR/path
+# The output only depends on COUNT, an existing tree is reused.
+
+dir=$1
+count=$2
+[ -n "$dir" ] && [ -n "$count" ] || { echo "usage: $0 DIR COUNT" >&2; exit 1; }
+[ -f "$dir/path" ] && [ "$(cat "$dir/count")" = "$count" ] && exit 0
+
+rm -rf "$dir"
+mkdir -p "$dir/applications" "$dir/entries" "$dir/icons/bench" "$dir/icons/hicolor/24x24/apps"
+
+# 60 icon subdirectories, the icons are spread over two of them
+sizes="16 22 24 32 48 64 96 128 256 512"
+contexts="apps categories devices mimetypes places status"
+subdirs=
+for size in $sizes; do
+	for context in $contexts; do
+		subdirs="$subdirs${subdirs:+,}${size}x${size}/$context"
+	done
+done
+{
+	printf '[Icon Theme]\nName=bench\nInherits=hicolor\nDirectories=%s\n' "$subdirs"
+	for size in $sizes; do
+		for context in $contexts; do
+			printf '\n[%sx%s/%s]\nSize=%s\nType=Fixed\n' $size $size $context $size
+		done
+	done
+} > "$dir/icons/bench/index.theme"
+printf '[Icon Theme]\nName=hicolor\nDirectories=24x24/apps\n\n[24x24/apps]\nSize=24\nType=Threshold\n' \
+	> "$dir/icons/hicolor/index.theme"
+for subdir in 24x24/apps 48x48/apps 24x24/categories; do
+	mkdir -p "$dir/icons/bench/$subdir"
+done
+i=0
+while [ $i -lt 500 ]; do
+	case $((i % 3)) in
+		0) touch "$dir/icons/bench/24x24/apps/icon$i.png" ;;
+		1) touch "$dir/icons/bench/48x48/apps/icon$i.svg" ;;
+		2) touch "$dir/icons/hicolor/24x24/apps/icon$i.png" ;;
+	esac
+	i=$((i + 1))
+done
+for icon in accessories development education games graphics internet \
+		multimedia office other science system; do
+	touch "$dir/icons/bench/24x24/categories/applications-$icon.svg"
+done
+
+# a long PATH, with some filler files in every directory
+path=
+i=0
+while [ $i -lt 50 ]; do
+	mkdir -p "$dir/bin/$i"
+	printf '#!/bin/sh\n' > "$dir/bin/$i/bench-$i"
+	chmod +x "$dir/bin/$i/bench-$i"
+	j=0
+	while [ $j -lt 20 ]; do
+		touch "$dir/bin/$i/filler-$i-$j"
+		j=$((j + 1))
+	done
+	path="$path${path:+:}$dir/bin/$i"
+	i=$((i + 1))
+done
+
+categories="AudioVideo Development Education Game Graphics Network Office Science Settings System Utility"
+set -- $categories
+ncategories=$#
+i=0
+while [ $i -lt "$count" ]; do
+	set -- $categories
+	shift $((i % ncategories))
+	file="$dir/applications/app$i.desktop"
+	[ $((i % 10)) -eq 9 ] && file="$dir/entries/app$i.desktop"
+	{
+		printf '[Desktop Entry]\nType=Application\nVersion=1.0\n'
+		printf 'Name=App %d\nName[de]=Anwendung %d\nName[fr]=Application %d\n' $i $i $i
+		[ $((i % 3)) -eq 0 ] && printf 'GenericName=Generic %d\nGenericName[de]=Allgemein %d\n' $i $i
+		printf 'Comment=Synthetic entry %d\nComment[de]=Synthetischer Eintrag %d\n' $i $i
+		printf 'Exec=bench-%d --open %%U\n' $((i % 50))
+		[ $((i % 5)) -eq 0 ] && printf 'TryExec=bench-%d\n' $((i % 60))
+		printf 'Icon=icon%d\n' $((i % 600))
+		[ $((i % 7)) -eq 0 ] && printf 'Terminal=true\n'
+		[ $((i % 20)) -eq 0 ] && printf 'NoDisplay=true\n'
+		printf 'Categories=GTK;%s;\nKeywords=bench;entry;%d;\n' "$1" $i
+		printf 'Actions=new;\n\n[Desktop Action new]\nName=New Window\nExec=bench-%d --new\n' $((i % 50))
+	} > "$file"
+	[ $((i % 10)) -eq 9 ] && ln -s "../entries/app$i.desktop" "$dir/applications/app$i.desktop"
+	i=$((i + 1))
+done
+
+echo "$count" > "$dir/count"
+echo "$path" > "$dir/path"
@@ -1,11 +1,175 @@
 #include <gtk/gtk.h>
 
-extern int xdgmenu(int argc, char *argv[]);
+#include "xdg-xmenu.h"
 
-    static void print_hello(GtkWidget *widget, gpointer data) {
-  //   g_print ("Hello World\n");
-  char *cmd[] = {"xdg-menu"};
-  xdgmenu(1,cmd);
+/* size of the icons in the GtkMenu, the same as the default of xdg-xmenu */
+#define ICON_SIZE 24
+
+/* kept while the app runs, see xdg-xmenu.h */
+static xdgmenu_ctx *ctx;
+/* show the menu as a GtkMenu instead of with xmenu */
+static gboolean use_gtk_menu;
+/* the GtkMenu of the last rendered menu, rebuilt when the menu changes */
+static GtkWidget *native_menu;
+/* icons by their path, decoded once while the app runs, NULL if it failed */
+static GHashTable *icon_cache;
+
+static GOptionEntry options[] = {
+    {"gtk-menu", 'g', 0, G_OPTION_ARG_NONE, &use_gtk_menu,
+     "Show the menu as a GtkMenu instead of with xmenu", NULL},
+    {NULL}};
+
+static void unref_icon(gpointer pixbuf) {
+  if (pixbuf)
+    g_object_unref(pixbuf);
+}
+
+static GdkPixbuf *load_icon(const char *path) {
+  GdkPixbuf *pixbuf;
+
+  if (g_hash_table_lookup_extended(icon_cache, path, NULL, (gpointer *)&pixbuf))
+    return pixbuf;
+  pixbuf = gdk_pixbuf_new_from_file_at_size(path, ICON_SIZE, ICON_SIZE, NULL);
+  g_hash_table_insert(icon_cache, g_strdup(path), pixbuf);
+  return pixbuf;
+}
+
+/* an item that has no submenu starts its command */
+static void launch_item(GtkMenuItem *item, gpointer command) {
+  if (!gtk_menu_item_get_submenu(item))
+    xdgmenu_ctx_launch(ctx, command);
+}
+
+static GtkWidget *new_item(const char *label, const char *icon_path) {
+  GtkWidget *item, *box;
+  GdkPixbuf *pixbuf;
+
+  item = gtk_menu_item_new();
+  box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 6);
+  if (icon_path && (pixbuf = load_icon(icon_path)) != NULL)
+    gtk_container_add(GTK_CONTAINER(box), gtk_image_new_from_pixbuf(pixbuf));
+  gtk_container_add(GTK_CONTAINER(box), gtk_label_new(label));
+  gtk_container_add(GTK_CONTAINER(item), box);
+  return item;
+}
+
+/*
+ * Build a GtkMenu from a menu in the xmenu format: one item per line, its
+ * depth is the number of leading tabs, then "[IMG:icon\t]label[\tcommand]".
+ */
+static GtkWidget *build_menu(const char *menu) {
+  GtkWidget *menus[8] = {gtk_menu_new()}, *items[8] = {NULL}, *item;
+  gchar **lines = g_strsplit(menu, "\n", -1), **fields;
+  const char *line, *icon, *label, *command;
+  int depth;
+
+  for (int i = 0; lines[i]; i++) {
+    line = lines[i];
+    for (depth = 0; line[depth] == '\t'; depth++)
+      ;
+    if (line[depth] == '\0' || depth >= G_N_ELEMENTS(menus) - 1)
+      continue;
+    /* the first item at this depth opens a submenu of the last parent */
+    if (depth > 0 && !menus[depth]) {
+      if (!items[depth - 1])
+        continue;
+      menus[depth] = gtk_menu_new();
+      gtk_menu_item_set_submenu(GTK_MENU_ITEM(items[depth - 1]), menus[depth]);
+    }
+
+    fields = g_strsplit(line + depth, "\t", 3);
+    icon = NULL;
+    label = fields[0];
+    command = fields[1];
+    if (g_str_has_prefix(fields[0], "IMG:") && fields[1]) {
+      icon = fields[0] + 4;
+      label = fields[1];
+      command = fields[2];
+    }
+    item = new_item(label, icon);
+    if (command)
+      g_signal_connect_data(item, "activate", G_CALLBACK(launch_item),
+                            g_strdup(command), (GClosureNotify)g_free, 0);
+    gtk_menu_shell_append(GTK_MENU_SHELL(menus[depth]), item);
+    g_strfreev(fields);
+
+    items[depth] = item;
+    for (int j = depth + 1; j < G_N_ELEMENTS(menus); j++)
+      menus[j] = items[j] = NULL;
+  }
+  g_strfreev(lines);
+  gtk_widget_show_all(menus[0]);
+  return menus[0];
+}
+
+/* runs in a worker thread, the first click is then a cache hit */
+static void refresh_menu(GTask *task, gpointer source, gpointer data,
+                         GCancellable *cancellable) {
+  g_task_return_boolean(task, xdgmenu_ctx_refresh(ctx));
+}
+
+/* back on the main loop, rebuild the GtkMenu if the menu changed */
+static void menu_refreshed(GObject *source, GAsyncResult *result,
+                           gpointer popup) {
+  char *menu;
+  gboolean changed = g_task_propagate_boolean(G_TASK(result), NULL);
+
+  /* with xmenu, the refresh at startup only fills the caches */
+  if (!use_gtk_menu)
+    return;
+  if (changed || !native_menu) {
+    xdgmenu_ctx_render(ctx, &menu);
+    if (native_menu)
+      gtk_widget_destroy(native_menu);
+    native_menu = build_menu(menu);
+    gtk_menu_attach_to_widget(GTK_MENU(native_menu), GTK_WIDGET(source), NULL);
+    free(menu);
+  }
+  if (GPOINTER_TO_INT(popup))
+    gtk_menu_popup_at_widget(GTK_MENU(native_menu), GTK_WIDGET(source),
+                             GDK_GRAVITY_SOUTH_WEST, GDK_GRAVITY_NORTH_WEST,
+                             NULL);
+}
+
+static void start_refresh(GtkWidget *button, gboolean popup) {
+  GTask *task =
+      g_task_new(button, NULL, menu_refreshed, GINT_TO_POINTER(popup));
+
+  g_task_run_in_thread(task, refresh_menu);
+  g_object_unref(task);
+}
+
+/* runs in a worker thread, blocked until xmenu exits */
+static void run_menu(GTask *task, gpointer source, gpointer data,
+                     GCancellable *cancellable) {
+  xdgmenu_ctx_refresh(ctx);
+  xdgmenu_ctx_show(ctx);
+  g_task_return_boolean(task, TRUE);
+}
+
+/* back on the main loop once the menu is closed */
+static void menu_closed(GObject *source, GAsyncResult *result, gpointer data) {
+  gtk_widget_set_sensitive(GTK_WIDGET(source), TRUE);
+}
+
+static void show_menu(GtkWidget *widget, gpointer data) {
+  GTask *task;
+
+  if (use_gtk_menu) {
+    /* show the menu at hand, it is refreshed for the next time meanwhile */
+    if (native_menu)
+      gtk_menu_popup_at_widget(GTK_MENU(native_menu), widget,
+                               GDK_GRAVITY_SOUTH_WEST, GDK_GRAVITY_NORTH_WEST,
+                               NULL);
+    start_refresh(widget, native_menu == NULL);
+    return;
+  }
+
+  /* one menu at a time */
+  task = g_task_new(widget, NULL, menu_closed, NULL);
+  gtk_widget_set_sensitive(widget, FALSE);
+  g_task_run_in_thread(task, run_menu);
+  g_object_unref(task);
 }
 
 static void activate(GtkApplication *app, gpointer user_data) {
@@ -21,22 +185,30 @@ static void activate(GtkApplication *app, gpointer user_data) {
   gtk_container_add(GTK_CONTAINER(window), button_box);
 
   button = gtk_button_new_with_label("Apps");
-  g_signal_connect(button, "clicked", G_CALLBACK(print_hello), NULL);
+  g_signal_connect(button, "clicked", G_CALLBACK(show_menu), NULL);
   //   g_signal_connect_swapped (button, "clicked", G_CALLBACK
   //   (gtk_widget_destroy), window);
   gtk_container_add(GTK_CONTAINER(button_box), button);
 
   gtk_widget_show_all(window);
+  start_refresh(button, FALSE);
 }
 
 int main(int argc, char **argv) {
+  static char *args[] = {"xapps", "-c", NULL};
   GtkApplication *app;
   int status;
 
+  if ((ctx = xdgmenu_ctx_new(2, args)) == NULL)
+    return 1;
+  icon_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, unref_icon);
   app = gtk_application_new("org.gtk.example", G_APPLICATION_FLAGS_NONE);
+  g_application_add_main_option_entries(G_APPLICATION(app), options);
   g_signal_connect(app, "activate", G_CALLBACK(activate), NULL);
   status = g_application_run(G_APPLICATION(app), argc, argv);
   g_object_unref(app);
+  g_hash_table_destroy(icon_cache);
+  xdgmenu_ctx_free(ctx);
 
   return status;
-}
\ No newline at end of file
+}
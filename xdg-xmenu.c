@@ -4,41 +4,98 @@
  *             https://specifications.freedesktop.org/icon-theme-spec
  */
 
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include <ini.h>
 
+#include "xdg-xmenu.h"
+
 /* for long texts */
 #define LLEN 1024
 /* for file paths */
 #define MLEN 256
 /* for simple names or directories */
 #define SLEN 128
+/* desktop entries a parsing thread takes at a time */
+#define BATCH 16
+/* size of the first memory block of an arena */
+#define ARENA_BLOCK 65536
+/* the usage log is compacted to USAGE_KEEP records when it reaches USAGE_MAX */
+#define USAGE_MAX 4096
+#define USAGE_KEEP 1024
+/* entries in the Recent category of -f */
+#define RECENT_COUNT 8
+/* bytes scan_line may read past the end of the data */
+#define SCAN_PAD 16
+/* [Desktop Action] groups kept per desktop entry with -a */
+#define MAX_ACTIONS 16
+/* converts an svg icon to png for -R, called as RASTERIZER -a -w SIZE -h SIZE -o PNG SVG */
+#define RASTERIZER "rsvg-convert"
 
 #define LEN(X) (sizeof(X) / sizeof(X[0]))
+/* string of an offset into the string pool of the current thread */
+#define STR(S) ((S) ? pool->data + (S) : "")
+/* category of an app before it is known */
+#define NO_CATEGORY 0xff
+/* count a syscall or desktop entry for -T, from any thread */
+#define COUNT(X) __atomic_add_fetch(&stats.X, 1, __ATOMIC_RELAXED)
 
 struct Option {
 	char *fallback_icon;
 	char *icon_theme;
+	char *query;
 	char *terminal;
+	char *variants;
 	char *xmenu_cmd;
+	int actions;
+	int client;
+	int daemon;
 	int debug;
 	int dry_run;
 	int dump;
+	int frecency;
 	int icon_size;
+	int jobs;
+	int low_memory;
+	int no_cache;
 	int no_genname;
 	int no_icon;
+	int pipe_size;
+	int rasterize;
 	int scale;
-} option = {
+	int timing;
+};
+
+/* options of the running context, see xdgmenu_ctx */
+struct Option option, default_option = {
 	.fallback_icon = "application-x-executable",
 	.icon_size = 24,
 	.scale = 1,
@@ -46,49 +103,238 @@ struct Option {
 	.xmenu_cmd = "xmenu"
 };
 
+/* a launch in the usage log, see usage_record */
+typedef struct UsageRecord {
+	uint32_t id;    /* hash_str of the command */
+	uint32_t time;
+} UsageRecord;
+
+/* the summed up usage of a command, see usage_load */
+typedef struct UsageScore {
+	uint32_t id;
+	int score;
+} UsageScore;
+
+/* a line of the menu with its submenu, as sorted by frecency_sort */
+typedef struct MenuItem {
+	const char *text;
+	size_t len;
+	int score;
+	int order;
+} MenuItem;
+
+/* counters and thread times printed by -T */
+struct Stats {
+	size_t access;
+	size_t open;
+	size_t stat;
+	size_t parsed;
+	size_t rejected;
+	size_t shadowed;
+	int64_t parse_ns;  /* summed over the parsing threads */
+	int64_t icon_ns;
+} stats;
+/* bytes held by the subsystems, printed by -T, see mem_add */
+xdgmenu_memory memory;
+const char *memory_names[XDGMENU_MEM_KINDS] = {"apps", "lists", "strings", "icon index",
+	"caches", "usage", "menus"};
+/* bytes accounted by a parsing thread, added to memory by parse_worker at the end */
+__thread ssize_t memory_pending[XDGMENU_MEM_KINDS];
+/* if set, -T hands the stage times to this function instead of printing them */
+void (*timing_hook)(const char *stage, int64_t wall_ns, int64_t cpu_ns);
+
+/* offset into a string pool, 0 is the empty string */
+typedef uint32_t Str;
+
 typedef struct App {
 	/* from desktop entry file */
-	char category[SLEN];
-	char exec[MLEN];
-	char genericname[SLEN];
-	char icon[SLEN];
-	char name[SLEN];
-	char path[MLEN];
-	char type[SLEN];
-	int terminal;
+	Str exec;
+	Str genericname;
+	Str icon;
+	Str keywords;
+	Str name;
+	Str path;
+	Str actions;  /* name, Exec and Icon of each desktop action with -a, see parse_desktop_file */
+	unsigned char nactions;
+	unsigned char application;
+	unsigned char category;  /* index into category_icons */
+	unsigned char terminal;
 	/* derived attributes */
-	char entry_path[LLEN];
-	char xmenu_entry[LLEN];
-	int not_show;
+	unsigned char not_show;
+	Str entry_path;
+	Str xmenu_entry;
+	Str launch_record;  /* of the app, then of its actions, see gen_entry */
+	uint32_t line;      /* offset of xmenu_entry in the menu or its category, see search_index */
 	struct App *next;
 } App;
 
+/* growing string, also used as a string pool */
+typedef struct Buffer {
+	char *data;
+	size_t len;
+	size_t size;
+} Buffer;
+
+typedef struct Block {
+	struct Block *next;
+	size_t size;
+	size_t used;
+	char data[];
+} Block;
+
+/* bump allocator, memory is only given back all at once by arena_reset */
+typedef struct Arena {
+	Block *head;
+	size_t bytes[XDGMENU_MEM_KINDS];  /* allocated for each subsystem, see mem_add */
+} Arena;
+
+typedef struct HashEntry {
+	char *key;
+	void *value;
+	int data;
+} HashEntry;
+
+/* open addressing hash table with string keys, size is a power of 2 */
+typedef struct HashTable {
+	HashEntry *entries;
+	size_t size;
+	size_t count;
+	int kind;  /* subsystem of its memory, kept by hash_free */
+} HashTable;
+
+/* the apps of a menu category, in an array from the arena */
+typedef struct Bucket {
+	App **apps;
+	size_t count;
+} Bucket;
+
+/*
+ * An app sorted by sort_apps: its case folded name, and the first 8 bytes
+ * of it in an integer, which decide most comparisons on their own
+ */
+typedef struct SortKey {
+	uint64_t prefix;
+	const char *key;
+	App *app;
+} SortKey;
+
+/* a trigram of the search index while it is built, see search_index */
+typedef struct Trigram {
+	uint32_t key;    /* the 3 bytes, 0 for a free slot */
+	uint32_t start;  /* of its apps in the postings */
+	uint32_t count;
+	uint32_t last;   /* the last app counted, plus 1 */
+} Trigram;
+
+/* an app matching a query, see search_menu */
+typedef struct SearchResult {
+	int score;
+	const char *text;
+	uint32_t line;
+} SearchResult;
+
+/* a [Desktop Action] group, its values are in the data of parse_desktop_file */
+typedef struct Action {
+	const char *id;
+	size_t id_len;
+	const char *name;
+	const char *exec;
+	const char *icon;
+	int name_rank;
+} Action;
+
+/* desktop entries to be parsed by the threads in find_all_apps */
+typedef struct ParseJob {
+	char **paths;
+	App **apps;
+	size_t count;
+	size_t capacity;
+	size_t next;
+	/* arena and pool of the calling thread, get the memory of the threads */
+	Arena *arena;
+	Buffer *pool;
+	pthread_mutex_t lock;
+} ParseJob;
+
+/* a running conversion of -R, see rasterize_icons */
+typedef struct RasterJob {
+	pid_t pid;
+	const char *svg;
+	struct timespec mtime;  /* of the svg, given to the png */
+	char png[MLEN];
+	char tmp[MLEN + 16];
+} RasterJob;
+
 typedef struct List {
-	char text[SLEN];
+	char text[MLEN];
 	int fd;
 	struct List *next;
 } List;
 
+/*
+ * A library user's state, see xdg-xmenu.h. The menu is kept with the
+ * launch records of its commands, as cut off and indexed by menu_split.
+ * With -L, the menu and its search index are dropped once rendered, see
+ * ctx_drop, the launch records stay for the launch that may follow.
+ */
+struct xdgmenu_ctx {
+	struct Option option;
+	/* options after `--', for xmenu */
+	int xmenu_argc;
+	char **xmenu_argv;
+	char *menu;
+	size_t menu_len;
+	Buffer launch_table;
+	/* the records of launch_table by command */
+	HashTable commands;
+	/* the search index after the menu and its NUL, see search_index */
+	const char *search;
+	size_t search_len;
+	/* of the last menu, to tell if a refresh changed it after ctx_drop */
+	uint32_t menu_hash;
+	/* the usage log of -f, as found by the last refresh */
+	char usage_file[MLEN];
+	/* the pids of launched apps that are not reaped yet, see launch */
+	Buffer launched;
+	/* guards all of the above, held by a refresh only to swap them */
+	pthread_mutex_t lock;
+};
+
+/* matching subdirectories and parents of an icon theme, see handler_icon_dirs_theme */
+typedef struct ThemeIndex {
+	List subdirs;
+	char inherits[MLEN];
+} ThemeIndex;
+
+/* indexes into category_icons */
+enum MenuCategory {
+	MENU_ACCESSORIES, MENU_DEVELOPMENT, MENU_EDUCATION, MENU_GAMES, MENU_GRAPHICS,
+	MENU_INTERNET, MENU_MULTIMEDIA, MENU_OFFICE, MENU_OTHERS, MENU_SCIENCE,
+	MENU_SETTINGS, MENU_SYSTEM
+};
+
+/* sorted for bsearch, the first member is the name like in category_icons */
 struct Category2Name {
 	char *category;
-	char *name;
+	enum MenuCategory menu;
 } xdg_categories[] = {
-	{"Audio", "Multimedia"},
-	{"AudioVideo", "Multimedia"},
-	{"Development", "Development"},
-	{"Education", "Education"},
-	{"Game", "Games"},
-	{"Graphics", "Graphics"},
-	{"Network", "Internet"},
-	{"Office", "Office"},
-	{"Others", "Others"},
-	{"Science", "Science"},
-	{"Settings", "Settings"},
-	{"System", "System"},
-	{"Utility", "Accessories"},
-	{"Video", "Multimedia"}
+	{"Audio", MENU_MULTIMEDIA},
+	{"AudioVideo", MENU_MULTIMEDIA},
+	{"Development", MENU_DEVELOPMENT},
+	{"Education", MENU_EDUCATION},
+	{"Game", MENU_GAMES},
+	{"Graphics", MENU_GRAPHICS},
+	{"Network", MENU_INTERNET},
+	{"Office", MENU_OFFICE},
+	{"Others", MENU_OTHERS},
+	{"Science", MENU_SCIENCE},
+	{"Settings", MENU_SETTINGS},
+	{"System", MENU_SYSTEM},
+	{"Utility", MENU_ACCESSORIES},
+	{"Video", MENU_MULTIMEDIA}
 };
 
+/* the menu categories, App.category is an index into this sorted array */
 struct Name2Icon {
 	char *category;
 	char *icon;
@@ -108,19 +354,31 @@ struct Name2Icon {
 };
 
 const char *usage_str =
-	"xdg-xmenu [-dGhIn] [-b ICON] [-i THEME] [-s SIZE] [-S SCALE] [-t TERMINAL] [-x CMD] [-- <xmenu_args>]\n\n"
+	"xdg-xmenu [-acCdfGhILnrRT] [-b ICON] [-i THEME] [-j JOBS] [-p BYTES] [-q TEXT] [-s SIZE] [-S SCALE] [-t TERMINAL] [-V LIST] [-x CMD] [-- <xmenu_args>]\n\n"
 	"Generate XDG menu for xmenu.\n\n"
 	"Options:\n"
 	"  -h          Show this help message and exit\n"
+	"  -a          Show the desktop actions of the apps in submenus\n"
 	"  -b ICON     Fallback icon name, default is application-x-executable\n"
+	"  -c          Get the menu from a running daemon (see -r) if possible\n"
+	"  -C          Do not use or update the caches\n"
 	"  -d          Dump generated menu, do not run xmenu\n"
+	"  -f          Sort apps by usage and add a Recent category, record launches\n"
 	"  -G          Do not show generic name of the app\n"
 	"  -i THEME    Icon theme for app icons. Default to gtk3 settings\n"
 	"  -I          Disable icon in xmenu\n"
+	"  -j JOBS     Threads to parse desktop entries, default is the CPU count\n"
+	"  -L          Drop the icon index and the menu after each use, to save memory\n"
 	"  -n          Do not run app, output to stdout\n"
+	"  -p BYTES    Pipe buffer size for the menu, default is the menu size\n"
+	"  -q TEXT     Show only the apps matching all words of TEXT, best first\n"
+	"  -r          Run as a daemon, keep the menu up to date in memory\n"
+	"  -R          Convert svg icons to png once, with " RASTERIZER "\n"
 	"  -s SIZE     Icon size for app icons\n"
 	"  -S SCALE    Icon scale factor, useful in HiDPI screens\n"
 	"  -t TERMINAL Terminal emulator to use, default is xterm\n"
+	"  -T          Print the time of each stage and syscall counts to stderr\n"
+	"  -V LIST     Save the menus for a list of SIZE[@SCALE] to the cache, e.g. 24,48@2\n"
 	"  -x CMD      Xmenu command to use, default is xmenu\n"
 	"Note:\n  Options after `--' are passed to xmenu\n";
 
@@ -129,53 +387,493 @@ char HOME[SLEN];
 char XDG_DATA_HOME[SLEN];
 char XDG_DATA_DIRS[LLEN];
 char XDG_CONFIG_HOME[SLEN];
+char XDG_CACHE_HOME[SLEN];
+char XDG_RUNTIME_DIR[SLEN];
 char XDG_CURRENT_DESKTOP[SLEN];
+/* LC_ALL, LC_MESSAGES or LANG */
+char LOCALE[SLEN];
 char DATA_DIRS[LLEN + MLEN];
 char FALLBACK_ICON_PATH[MLEN];
 char FALLBACK_ICON_THEME[SLEN] = "hicolor";
+/* room for XDG_CACHE_HOME and /xdg-xmenu, so that the files in it fit MLEN */
+char CACHE_DIR[SLEN + 16];
+char CACHE_FILE[MLEN];
+char RASTER_DIR[MLEN];
+char THEME_CACHE_FILE[MLEN];
+char SOCKET_PATH[MLEN];
+char USAGE_FILE[MLEN];
+/*
+ * The locales of localized keys to use, the best match first: for LOCALE
+ * lang_COUNTRY.ENCODING@MODIFIER these are lang_COUNTRY@MODIFIER,
+ * lang_COUNTRY, lang@MODIFIER and lang, see locale_rank.
+ */
+char locale_keys[4][SLEN];
+int locale_count;
+/* data_dirs_list is in the order of priority, XDG_DATA_HOME first */
 List icon_dirs, path_list, data_dirs_list, current_desktop_list;
+/* applications folders and their subfolders, see find_all_apps */
+List app_folders;
+/* index.theme files of the icon theme and the themes it inherits */
+List theme_files;
+/* icon name -> best match, value is the icon dir and data the extension */
+HashTable icon_index = {.kind = XDGMENU_MEM_ICONS};
+/* the svg icons seen by rasterize_icons, data is the Str of their png or 0 */
+HashTable raster_index = {.kind = XDGMENU_MEM_ICONS};
+/* names of the files in $PATH -> directory, to check TryExec */
+HashTable path_index = {.kind = XDGMENU_MEM_CACHES};
+const char *icon_exts[] = {"svg", "png", "xpm"};
+/* inotify watches of the daemon, fd is the watch descriptor */
+List app_watches, icon_watches, theme_watches;
 App all_apps;
+/* the apps of all_apps by category, as found by find_all_apps */
+Bucket app_buckets[LEN(category_icons)];
+/* menu kept in memory by the daemon, rendered from one fragment per category */
+Buffer daemon_menu;
+/* the length of the menu in daemon_menu, and the offset of its search index or 0 */
+size_t daemon_menu_len, daemon_search;
+Buffer daemon_fragments[LEN(category_icons)];
+/* bit i is set if category i changed since its fragment was rendered */
+uint32_t daemon_dirty;
+/* apps removed by the daemon, their memory is only reused after a reload */
+size_t daemon_stale_apps;
+/* the size of the buffers above, as last accounted by daemon_count_menus */
+size_t daemon_menu_bytes;
+/* set by daemon_stop */
+volatile sig_atomic_t daemon_stopped;
+/* scores of the usage log sorted by id, only loaded with -f */
+UsageScore *usage_scores;
+size_t usage_count;
+/* icon paths of the category headers, bit i of category_icons_found is set
+ * once the one of category i is looked up, see xmenu_header */
+char category_icon_paths[LEN(category_icons)][MLEN];
+uint32_t category_icons_found;
+/*
+ * The globals are shared by all contexts, a refresh holds run_lock while it
+ * uses them, see xdgmenu_ctx_refresh.
+ */
+pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER;
+/* guards the usage scores and the usage log, for a render or a launch of -f */
+pthread_mutex_t usage_lock = PTHREAD_MUTEX_INITIALIZER;
+/* the kernel of scan_line for this CPU, picked once by scan_select */
+char *(*scan_kernel)(char *line, char *end, char **eq, char **bracket);
+pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+/*
+ * All apps and lists are allocated from the arena pointed to by "arena".
+ * The memory of one run is released in one go at the end of xdgmenu().
+ * The daemon has its own arena, which is reset on every full reload.
+ */
+Arena run_arena, daemon_arena;
+__thread Arena *arena = &run_arena;
+/* strings of the apps, the same way as the arenas above */
+Buffer run_pool, daemon_pool;
+__thread Buffer *pool = &run_pool;
 
-int  cmp_app_category_name(const void *p1, const void *p2);
+void app_rebase(App *app, Str base);
+void *arena_alloc(Arena *arena, size_t size, int kind);
+void arena_free(Arena *arena);
+void arena_merge(Arena *dest, Arena *src);
+void arena_reset(Arena *arena);
+void buffer_append(Buffer *buffer, const char *s, size_t len);
+void cache_fingerprint(FILE *fp);
+int  cache_load(FILE *fp, const char *fingerprint, size_t len);
+int  cache_save(const char *fingerprint, size_t flen, const char *menu, size_t mlen);
+void cache_stamp(FILE *fp, const char *path);
+void cache_stamp_tree(FILE *fp, const char *path);
+int  cmp_category(const void *name, const void *entry);
+int  cmp_menu_item(const void *p1, const void *p2);
+int  cmp_search_result(const void *p1, const void *p2);
+int  cmp_sort_key(const void *p1, const void *p2);
+int  cmp_trigram(const void *p1, const void *p2);
+int  cmp_usage_score(const void *p1, const void *p2);
 int  check_app(App *app);
 int  check_desktop(const char *desktop_list);
 int  check_exec(const char *cmd);
+int  check_file_ext(const char *name, const char *ext);
 void clean_up_lists();
+int  client_load(FILE *fp);
+int64_t clock_ns(clockid_t clock);
+void close_icon_dirs();
+void collect_apps(ParseJob *job, HashTable *ids, const char *folder, const char *prefix);
+void ctx_drop(xdgmenu_ctx *ctx);
+void ctx_reload(xdgmenu_ctx *ctx);
+void daemon_count_menus();
+void daemon_drop();
+void daemon_index_icons();
+int  daemon_listen();
+void daemon_load(int fd_inotify);
+void daemon_render();
+void daemon_render_category(int category);
+int  daemon_run();
+void daemon_serve(int fd_socket);
+void daemon_stop(int sig);
+void daemon_update(int fd_inotify);
+void daemon_update_app(const char *path);
+void daemon_watch(int fd_inotify, List *watches, const char *path, uint32_t mask);
 void debug_msg(const char *msg, ...);
-void extract_main_category(char *category, const char *categories);
+int  desktop_id(const char *path, char *id);
+void exec_quote(Buffer *buffer, const char *arg);
+int  exec_split(const char *exec, const App *app, Buffer *argv);
+int  extract_main_category(const char *categories);
 void find_all_apps();
+int  find_desktop_entry(const char *folder, const char *prefix, const char *id, char *path);
 void find_icon(char *icon_path, char *icon_name);
 void find_icon_dirs();
+void find_theme_dirs(const char *theme, List *visited);
+int64_t file_mtime(const char *path);
+void free_all_apps();
+void frecency_sort(char **menu, size_t *len);
 void gen_entry(App *app);
+void gen_launch(const App *app, const char *exec, Buffer *entry, Buffer *record);
 void getenv_fb(char *dest, char *name, char *fallback, int n);
 int  handler_icon_dirs_theme(void *user, const char *section, const char *name, const char *value);
-int  handler_parse_app(void *user, const char *section, const char *name, const char *value);
 int  handler_set_icon_theme(void *user, const char *section, const char *name, const char *value);
+HashEntry *hash_find(HashTable *table, const char *key, size_t len);
+void hash_free(HashTable *table);
+HashEntry *hash_insert(HashTable *table, const char *key, size_t len);
+uint32_t hash_str(const char *key, size_t len);
+void index_icons();
+void index_path();
+void launch(const char *command, HashTable *commands, Buffer *launched, int debug);
 void list_free(List *list);
+List *list_find_fd(List *list, int fd);
+int  locale_rank(const char *locale, size_t len);
 void list_insert(List *l, char *text, int n);
 void list_reverse(List *l);
+int  load_theme_cache();
+int  make_cache_dir();
+int  menu_category(const char *name);
+void menu_options(char *options, size_t size);
+void mem_add(int kind, ssize_t bytes);
+size_t menu_split(char *menu, size_t *len, Buffer *table, HashTable *commands);
+App *parse_app(const char *path);
+void parse_app_key(App *app, const char *key, size_t len, const char *value, size_t value_len);
+int  parse_desktop_file(const char *path, App *app);
+void *parse_worker(void *arg);
+void pack_actions(App *app, const char *actions, const Action *action_list, int count);
+void pack_str(Buffer *buffer, const char *s);
+Str  pool_add(Buffer *pool, const char *s, size_t len);
+void pool_reset(Buffer *pool);
 void prepare_envvars();
+void prepare_locale();
+void raster_add(Buffer *svgs, const char *icon_name);
+void raster_finish(RasterJob *job);
+void raster_icon(char *icon_path);
+void rasterize_icons();
 void xmenu_dump(FILE *fp);
-void xmenu_run(int argc, char *argv[]);
+void xmenu_dump_category(Buffer *buffer, App **apps, size_t count);
+void xmenu_launch_table(Buffer *buffer);
+void xmenu_header(char *header, size_t size, int category);
+char *xmenu_run(int pid, int fd_input, int fd_output, const char *menu, size_t len);
+int  xmenu_start(int argc, char *argv[], int *fd_input, int *fd_output);
+void xmenu_variants();
+void save_theme_cache();
+char *scan_line(char **line, char *end, char **eq);
+char *scan_masks(char *p, char *end, int shift, uint64_t lines, uint64_t eqs,
+		uint64_t brackets, char **eq, char **bracket);
+char *scan_neon(char *line, char *end, char **eq, char **bracket);
+char *scan_scalar(char *line, char *end, char **eq, char **bracket);
+void scan_select();
+char *scan_sse2(char *line, char *end, char **eq, char **bracket);
+void search_fold(Buffer *buffer, const char *s, size_t len);
+void search_index(Buffer *buffer, const size_t *bases);
+void search_menu(const char *index, size_t len, const char *menu, size_t menu_len, const char *query, Buffer *out);
+int  search_separator(char c);
+Trigram *search_slot(Trigram *slots, size_t size, uint32_t key);
+uint32_t search_u32(const char *index, size_t i);
+void sort_apps(App **apps, size_t count);
 void set_icon_theme();
 int  spawn(const char *cmd, char *const argv[], int *fd_input, int *fd_output);
 void split_to_list(List *list, const char *env_string, char *sep);
+void timing_stage(const char *stage);
+void timing_summary();
+int  unpack(char **p, const char *end, void *dest, size_t n);
+int  unpack_str(char **p, const char *end, char *dest, size_t size);
+void usage_free();
+size_t usage_load(const char *file);
+void usage_record(const char *file, const char *command);
+int  usage_score(const char *command, size_t len);
+int  write_all(int fd, const char *buffer, size_t len);
+
+/* Move the strings of an app, after its pool got appended to another one */
+void app_rebase(App *app, Str base)
+{
+	Str *fields[] = {&app->exec, &app->genericname, &app->icon, &app->keywords, &app->name,
+		&app->path, &app->actions, &app->entry_path, &app->xmenu_entry, &app->launch_record};
+
+	for (int i = 0; i < LEN(fields); i++)
+		if (*fields[i])
+			*fields[i] += base;
+}
+
+/* Return zeroed memory, aligned for any type, accounted for the subsystem kind */
+void *arena_alloc(Arena *arena, size_t size, int kind)
+{
+	void *p;
+	size_t block_size;
+	Block *block = arena->head;
+
+	size = (size + 15) & ~(size_t)15;
+	if (!block || block->used + size > block->size) {
+		/* double the block size every time, up to 1MB */
+		block_size = block ? 2 * block->size : ARENA_BLOCK;
+		if (block_size > 16 * ARENA_BLOCK)
+			block_size = 16 * ARENA_BLOCK;
+		if (block_size < size)
+			block_size = size;
+		if ((block = malloc(sizeof(Block) + block_size)) == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		block->size = block_size;
+		block->used = 0;
+		block->next = arena->head;
+		arena->head = block;
+	}
+	p = block->data + block->used;
+	block->used += size;
+	arena->bytes[kind] += size;
+	mem_add(kind, size);
+	return memset(p, 0, size);
+}
+
+/* Free all memory of an arena, the newest block too, for -L */
+void arena_free(Arena *arena)
+{
+	arena_reset(arena);
+	free(arena->head);
+	arena->head = NULL;
+}
+
+/* Move all memory of src into dest, dest keeps allocating from its head */
+void arena_merge(Arena *dest, Arena *src)
+{
+	Block *tail = src->head;
+
+	for (int i = 0; i < XDGMENU_MEM_KINDS; i++) {
+		dest->bytes[i] += src->bytes[i];
+		src->bytes[i] = 0;
+	}
+	if (!tail)
+		return;
+	while (tail->next)
+		tail = tail->next;
+	if (dest->head) {
+		tail->next = dest->head->next;
+		dest->head->next = src->head;
+	} else {
+		dest->head = src->head;
+	}
+	src->head = NULL;
+}
+
+/* Free everything but the newest block, which is kept for the next run */
+void arena_reset(Arena *arena)
+{
+	Block *block = arena->head, *tmp;
+
+	for (int i = 0; i < XDGMENU_MEM_KINDS; i++) {
+		mem_add(i, -(ssize_t)arena->bytes[i]);
+		arena->bytes[i] = 0;
+	}
+	if (!block)
+		return;
+	for (tmp = block->next, block->next = NULL, block->used = 0; tmp; ) {
+		block = tmp->next;
+		free(tmp);
+		tmp = block;
+	}
+}
+
+void buffer_append(Buffer *buffer, const char *s, size_t len)
+{
+	if (buffer->len + len + 1 > buffer->size) {
+		buffer->size = buffer->size ? buffer->size : 4096;
+		while (buffer->len + len + 1 > buffer->size)
+			buffer->size *= 2;
+		if ((buffer->data = realloc(buffer->data, buffer->size)) == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	memcpy(buffer->data + buffer->len, s, len);
+	buffer->len += len;
+	/* always keep the content terminated */
+	buffer->data[buffer->len] = '\0';
+}
+
+/*
+ * Write everything the generated menu depends on into fp. If the result
+ * equals the header of the cache file, the cached menu can be used as is.
+ * Directory mtimes change whenever a desktop entry is added, removed or
+ * replaced (package managers rename files into place), so this only costs
+ * a few stat calls. An entry edited in place is not seen, the daemon
+ * watches for that. The PATH directories decide the TryExec checks.
+ */
+void cache_fingerprint(FILE *fp)
+{
+	char path[MLEN + 16] = {0}, options[LLEN];
+
+	menu_options(options, sizeof(options));
+	fprintf(fp, "xdg-xmenu menu cache 4\n");
+	fprintf(fp, "options %s\n", options);
+	fprintf(fp, "path %s\n", PATH);
+	for (List *dir = path_list.next; dir; dir = dir->next)
+		cache_stamp(fp, dir->text);
+
+	for (List *dir = data_dirs_list.next; dir; dir = dir->next) {
+		snprintf(path, sizeof(path), "%s/applications", dir->text);
+		cache_stamp_tree(fp, path);
+	}
+	/* the icon theme cache is rewritten whenever an index.theme changed */
+	if (!option.no_icon)
+		cache_stamp(fp, THEME_CACHE_FILE);
+	snprintf(path, sizeof(path), "%s/gtk-3.0/settings.ini", XDG_CONFIG_HOME);
+	cache_stamp(fp, path);
+	/* an empty line ends the header */
+	fprintf(fp, "\n");
+}
+
+/* Copy the cached menu to fp if the cache file starts with fingerprint */
+int cache_load(FILE *fp, const char *fingerprint, size_t len)
+{
+	int fd, hit = 0;
+	char *buffer;
+	struct stat sb;
+
+	COUNT(open);
+	if ((fd = open(CACHE_FILE, O_RDONLY)) < 0)
+		return 0;
+	COUNT(stat);
+	if (fstat(fd, &sb) == 0 && sb.st_size > len
+		&& (buffer = malloc(sb.st_size)) != NULL) {
+		if (read(fd, buffer, sb.st_size) == sb.st_size
+			&& memcmp(buffer, fingerprint, len) == 0) {
+			fwrite(buffer + len, 1, sb.st_size - len, fp);
+			hit = 1;
+		}
+		free(buffer);
+	}
+	close(fd);
+	debug_msg("Menu cache %s: %s\n", hit ? "hit" : "miss", CACHE_FILE);
+	return hit;
+}
+
+int cache_save(const char *fingerprint, size_t flen, const char *menu, size_t mlen)
+{
+	char tmp_file[MLEN + 8] = {0};
+	FILE *fp;
+
+	if (!make_cache_dir())
+		return 0;
+
+	/* write to a temporary file and rename it, so that a concurrent
+	 * xdg-xmenu never reads a partially written cache */
+	snprintf(tmp_file, sizeof(tmp_file), "%s.%d", CACHE_FILE, getpid());
+	COUNT(open);
+	if ((fp = fopen(tmp_file, "w")) == NULL)
+		return 0;
+	fwrite(fingerprint, 1, flen, fp);
+	fwrite(menu, 1, mlen, fp);
+	if (fclose(fp) == 0 && rename(tmp_file, CACHE_FILE) == 0) {
+		debug_msg("Menu cache saved: %s\n", CACHE_FILE);
+		return 1;
+	}
+	unlink(tmp_file);
+	return 0;
+}
+
+void cache_stamp(FILE *fp, const char *path)
+{
+	struct stat sb;
+
+	COUNT(stat);
+	if (stat(path, &sb) == 0)
+		fprintf(fp, "%s %ld.%09ld %ld\n", path, (long)sb.st_mtim.tv_sec,
+				sb.st_mtim.tv_nsec, (long)sb.st_size);
+	else
+		fprintf(fp, "%s -\n", path);
+}
+
+/* Stamp a folder and its subfolders, the desktop entries can be in any of them */
+void cache_stamp_tree(FILE *fp, const char *path)
+{
+	char subdir[LLEN];
+	DIR *dir;
+	struct dirent *entry;
+
+	cache_stamp(fp, path);
+	COUNT(open);
+	if ((dir = opendir(path)) == NULL)
+		return;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_type != DT_DIR || entry->d_name[0] == '.')
+			continue;
+		/* the same limit as the paths of collect_apps */
+		if (snprintf(subdir, sizeof(subdir), "%s/%s", path, entry->d_name) >= sizeof(subdir))
+			continue;
+		cache_stamp_tree(fp, subdir);
+	}
+	closedir(dir);
+}
+
+/* for bsearch in xdg_categories and category_icons */
+int cmp_category(const void *name, const void *entry)
+{
+	return strcmp(name, *(char *const *)entry);
+}
+
+/* Higher scores first, otherwise keep the order of the menu */
+int cmp_menu_item(const void *p1, const void *p2)
+{
+	const MenuItem *i1 = p1, *i2 = p2;
+
+	if (i1->score != i2->score)
+		return i2->score - i1->score;
+	return i1->order - i2->order;
+}
+
+/* Higher scores first, then in the order of the search texts, i.e. of the names */
+int cmp_search_result(const void *p1, const void *p2)
+{
+	const SearchResult *r1 = p1, *r2 = p2;
+
+	if (r1->score != r2->score)
+		return r2->score - r1->score;
+	return strcmp(r1->text, r2->text);
+}
 
-int cmp_app_category_name(const void *p1, const void *p2)
+/* Names in the order of strcasecmp, ties are broken to be independent of the input order */
+int cmp_sort_key(const void *p1, const void *p2)
 {
-	int cmp_category, cmp_name;
-	App *a1 = *(App **)p1, *a2 = *(App **)p2;
+	const SortKey *k1 = p1, *k2 = p2;
+	int res;
+
+	if (k1->prefix != k2->prefix)
+		return k1->prefix < k2->prefix ? -1 : 1;
+	if ((res = strcmp(k1->key, k2->key)) != 0)
+		return res;
+	if ((res = strcmp(STR(k1->app->name), STR(k2->app->name))) != 0)
+		return res;
+	return strcmp(STR(k1->app->entry_path), STR(k2->app->entry_path));
+}
+
+int cmp_trigram(const void *p1, const void *p2)
+{
+	uint32_t k1 = ((const Trigram *)p1)->key, k2 = ((const Trigram *)p2)->key;
+
+	return (k1 > k2) - (k1 < k2);
+}
+
+int cmp_usage_score(const void *p1, const void *p2)
+{
+	const UsageScore *s1 = p1, *s2 = p2;
 
-	cmp_category = strcmp(a1->category, a2->category);
-	cmp_name = strcasecmp(a1->name, a2->name);
-	return cmp_category ? cmp_category : cmp_name;
+	return (s1->id > s2->id) - (s1->id < s2->id);
 }
 
 int check_app(App *app)
 {
-	if (strcmp(app->type, "Application") != 0
-		|| strlen(app->exec) == 0
-		|| strlen(app->name) == 0)
+	if (!app->application || !app->exec || !app->name)
 		return 0;
 	return 1;
 }
@@ -192,232 +890,1099 @@ int check_exec(const char *cmd)
 {
 	char file[MLEN] = {0};
 	struct stat sb;
+	HashEntry *entry;
 
 	/* if command start with '/', check it directly */
 	if (cmd[0] == '/')
-		return stat(cmd, &sb) == 0 && sb.st_mode & S_IXUSR;
+		return COUNT(stat) && stat(cmd, &sb) == 0 && sb.st_mode & S_IXUSR;
+
+	/* most commands are not found at all, which costs no stat here */
+	if ((entry = hash_find(&path_index, cmd, strlen(cmd))) == NULL)
+		return 0;
+	if (snprintf(file, MLEN, "%s/%s", ((List *)entry->value)->text, cmd) < MLEN
+		&& COUNT(stat) && stat(file, &sb) == 0 && sb.st_mode & S_IXUSR)
+		return 1;
 
+	/* not executable there, but there might be another one */
 	for (List *dir = path_list.next; dir; dir = dir->next) {
-		sprintf(file, "%s/%s", dir->text, cmd);
-		if (stat(file, &sb) == 0 && sb.st_mode & S_IXUSR)
+		if (snprintf(file, MLEN, "%s/%s", dir->text, cmd) < MLEN
+			&& COUNT(stat) && stat(file, &sb) == 0 && sb.st_mode & S_IXUSR)
 			return 1;
 	}
 	return 0;
 }
 
+int check_file_ext(const char *name, const char *ext)
+{
+	const char *dot = strrchr(name, '.');
+
+	return dot && strcmp(dot, ext) == 0;
+}
+
+/*
+ * Release everything of a run, -L gives back the memory kept for the next
+ * one too. Only the menus of the contexts and the usage scores of a render
+ * that runs meanwhile are left, anything else still accounted for is a leak.
+ */
 void clean_up_lists()
 {
-	for (List *dir = icon_dirs.next; dir; dir = dir->next)
-		if (dir->fd > 0) {
-			debug_msg("%d %s\n", dir->fd, dir->text);
-			close(dir->fd);
-		}
-	list_free(&icon_dirs);
+	close_icon_dirs();
+	hash_free(&path_index);
 	list_free(&path_list);
 	list_free(&data_dirs_list);
+	list_free(&app_folders);
 	list_free(&current_desktop_list);
-	for (App *p = all_apps.next, *tmp; p; tmp = p->next, free(p), p = tmp) ;
-	all_apps.next = NULL;
+	list_free(&app_watches);
+	list_free(&icon_watches);
+	list_free(&theme_watches);
+	free_all_apps();
+	pool_reset(&run_pool);
+	if (option.low_memory) {
+		arena_free(&run_arena);
+		free(run_pool.data);
+		memset(&run_pool, 0, sizeof(Buffer));
+	} else {
+		arena_reset(&run_arena);
+	}
 
+	memory.leaked = 0;
+	for (int i = 0; i < XDGMENU_MEM_KINDS; i++)
+		if (i != XDGMENU_MEM_MENUS && i != XDGMENU_MEM_USAGE)
+			memory.leaked += __atomic_load_n(&memory.used[i], __ATOMIC_RELAXED);
+	if (memory.leaked > 0)
+		debug_msg("Memory still in use after the cleanup: %zu bytes\n", memory.leaked);
 }
 
-void debug_msg(const char *msg, ...)
-{	
-	if (!option.debug)
-		return;
+/*
+ * Ask a running daemon (see -r) for the menu, return 0 if there is none or
+ * it was started with other options, see menu_options
+ */
+int client_load(FILE *fp)
+{
+	int fd, n, total = 0;
+	char buffer[4096], options[LLEN];
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
 
-	va_list args;
-	fprintf(stderr, "DEBUG: ");
-	va_start(args, msg);
-	vfprintf(stderr, msg, args);
-	va_end(args);
+	menu_options(options, sizeof(options));
+	n = snprintf(buffer, sizeof(buffer), "menu %s\n", options);
+	/* the daemon cannot listen on a truncated path either */
+	if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", SOCKET_PATH) >= sizeof(addr.sun_path))
+		return 0;
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return 0;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0
+		&& write_all(fd, buffer, n))
+		while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+			fwrite(buffer, 1, n, fp);
+			total += n;
+		}
+	close(fd);
+	debug_msg("Menu from daemon: %d bytes\n", total);
+	return total > 0;
 }
 
-void extract_main_category(char *category, const char *categories)
+/* Current time of a clock, in nanoseconds */
+int64_t clock_ns(clockid_t clock)
 {
-	List list_categories = {0}, *s;
+	struct timespec ts;
 
-	split_to_list(&list_categories, categories, ";");
-	for (s = list_categories.next; s; s = s->next)
-		for (int i = 0; i < LEN(xdg_categories); i++)
-			if (strcmp(xdg_categories[i].category, s->text) == 0)
-				snprintf(category, SLEN, "%s", xdg_categories[i].name);
+	clock_gettime(clock, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-	list_free(&list_categories);
+void close_icon_dirs()
+{
+	hash_free(&icon_index);
+	hash_free(&raster_index);
+	list_free(&icon_dirs);
+	list_free(&theme_files);
 }
 
-void find_all_apps()
+/*
+ * Add the desktop entries of an applications folder and its subfolders to
+ * the job, unless their desktop ID is taken. The ID of an entry is its
+ * path in the applications folder, with '/' replaced by '-', so prefix is
+ * the ID of the folder so far.
+ */
+void collect_apps(ParseJob *job, HashTable *ids, const char *folder, const char *prefix)
 {
-	int res;
-	char folder[MLEN] = {0}, path[LLEN] = {0}, *ext;
+	int is_dir;
+	char path[LLEN], id[LLEN];
 	DIR *dir;
 	struct dirent *entry;
-	App *app;
-
-	/* output all app in folder */
-	for (List *data_dir = data_dirs_list.next; data_dir; data_dir = data_dir->next) {
-		sprintf(folder, "%s/applications", data_dir->text);
-		if ((dir = opendir(folder)) == NULL)
-			continue;
+	struct stat sb;
 
-		while ((entry = readdir(dir)) != NULL) {
-			ext = strrchr(entry->d_name, '.');
-			if ((entry->d_type != DT_REG
-					&& entry->d_type != DT_LNK
-					&& entry->d_type != DT_UNKNOWN)  /* not file */
-				|| !ext || strcmp(ext, ".desktop") != 0) /* not desktop entry */
-				continue;
+	COUNT(open);
+	if ((dir = opendir(folder)) == NULL)
+		return;
+	list_insert(&app_folders, (char *)folder, MLEN);
 
-			app = calloc(1, sizeof(App));
-			sprintf(path, "%s/%s", folder, entry->d_name);
-			debug_msg("Ini parse app entry: %s\n", path);
-			if ((res = ini_parse(path, handler_parse_app, app)) > 0)
-				debug_msg("%s parse failed: %d\n", path, res);
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.')
+			continue;
+		snprintf(path, LLEN, "%s/%s", folder, entry->d_name);
+		snprintf(id, LLEN, "%s%s", prefix, entry->d_name);
+		is_dir = entry->d_type == DT_DIR;
+		if (entry->d_type == DT_UNKNOWN && !check_file_ext(entry->d_name, ".desktop"))
+			is_dir = COUNT(stat) && stat(path, &sb) == 0 && S_ISDIR(sb.st_mode);
+		if (is_dir) {
+			strcat(id, "-");
+			collect_apps(job, ids, path, id);
+			continue;
+		}
+		if ((entry->d_type != DT_REG
+				&& entry->d_type != DT_LNK
+				&& entry->d_type != DT_UNKNOWN)  /* not file */
+			|| !check_file_ext(entry->d_name, ".desktop")) /* not desktop entry */
+			continue;
 
-			if (!app->not_show && check_app(app)) {
-				gen_entry(app);
-				snprintf(app->entry_path, LLEN, "%s", path);
-				if (strlen(app->category) == 0)
-					snprintf(app->category, SLEN, "%s", "Others");
-				app->next = all_apps.next;
-				all_apps.next = app;
-			}
+		if (hash_find(ids, id, strlen(id))) {
+			debug_msg("Shadowed desktop entry: %s\n", path);
+			COUNT(shadowed);
+			continue;
 		}
-		closedir(dir);
+		hash_insert(ids, id, strlen(id));
+		if (job->count == job->capacity) {
+			job->capacity = job->capacity ? job->capacity * 2 : 256;
+			job->paths = realloc(job->paths, job->capacity * sizeof(char *));
+		}
+		job->paths[job->count++] = strdup(path);
 	}
+	closedir(dir);
 }
 
-void find_icon(char *icon_path, char *icon_name)
+/* Free the menu of a context and its search index, with its lock held */
+void ctx_drop(xdgmenu_ctx *ctx)
 {
-	const char *exts[] = {"svg", "png", "xpm"};
-	char test_path[SLEN] = {0};
-
-	/* provided icon is a file path */
-	if (icon_name[0] == '/') {
-		snprintf(icon_path, MLEN, "%s", access(icon_name, F_OK) == 0 ?
-				 icon_name : FALLBACK_ICON_PATH);
+	if (!ctx->menu)
 		return;
-	}
+	mem_add(XDGMENU_MEM_MENUS, -(ssize_t)(ctx->menu_len + 1 + ctx->search_len));
+	free(ctx->menu);
+	ctx->menu = NULL;
+	ctx->menu_len = 0;
+	ctx->search = NULL;
+	ctx->search_len = 0;
+}
 
-	for (List *dir = icon_dirs.next; dir; dir = dir->next) {
-		for (int i = 0; i < 3; i++) {
-			snprintf(test_path, SLEN, "%s.%s", icon_name, exts[i]);
-			/* use faccessat, might be faster than access
-			 * the reason is that the directory's fd is already opened */
-			if (faccessat(dir->fd, test_path, F_OK, 0) == 0) {
-				snprintf(icon_path, MLEN, "%s/%s", dir->text, test_path);
-				return;
-			}
-		}
-	}
-	snprintf(icon_path, MLEN, "%s", FALLBACK_ICON_PATH);
+/* Refresh a context whose menu was dropped by -L, before it is rendered */
+void ctx_reload(xdgmenu_ctx *ctx)
+{
+	int dropped;
+
+	pthread_mutex_lock(&ctx->lock);
+	dropped = !ctx->menu;
+	pthread_mutex_unlock(&ctx->lock);
+	if (dropped && ctx->option.low_memory)
+		xdgmenu_ctx_refresh(ctx);
 }
 
-void find_icon_dirs()
+/* Account for the buffers of the menu, after they grew or were freed */
+void daemon_count_menus()
 {
-	int res, len_parent;
-	char dir_parent[SLEN] = {0}, index_theme[MLEN] = {0};
+	size_t bytes = daemon_menu.size;
 
-	for (List *dir = data_dirs_list.next; dir; dir = dir->next) {
-		snprintf(index_theme, MLEN, "%s/icons/%s/index.theme", dir->text, option.icon_theme);
-		if (access(index_theme, F_OK) == 0) {
-			debug_msg("Ini parse icon theme: %s\n", index_theme);
-			if ((res = ini_parse(index_theme, handler_icon_dirs_theme, NULL)) > 0)
-				debug_msg("%s parse failed: %d\n", index_theme, res);
-			/* mannually call, a hack to process the end of file */
-			handler_icon_dirs_theme(NULL, "", NULL, NULL);
-		}
+	for (int i = 0; i < LEN(category_icons); i++)
+		bytes += daemon_fragments[i].size;
+	mem_add(XDGMENU_MEM_MENUS, bytes - daemon_menu_bytes);
+	daemon_menu_bytes = bytes;
+}
 
-		/* prepend dirs with parent path */
-		len_parent = snprintf(dir_parent, SLEN, "%s/icons/%s/", dir->text, option.icon_theme);
-		for (List *idir = icon_dirs.next; idir; idir = idir->next) {
-			/* FIXME: This is hacky, change this */
-			if (idir->text[0] != '/') {
-				strncpy(idir->text + len_parent, idir->text, strlen(idir->text));
-				memcpy(idir->text, dir_parent, strlen(dir_parent));
-			}
-		}
+/*
+ * Free the icon index and the menu after a request with -L, the fragments
+ * of the categories are kept. daemon_render puts the menu together again.
+ */
+void daemon_drop()
+{
+	hash_free(&icon_index);
+	hash_free(&raster_index);
+	free(daemon_menu.data);
+	memset(&daemon_menu, 0, sizeof(Buffer));
+	daemon_menu_len = daemon_search = 0;
+}
+
+/* Index the icons again if -L dropped them, before entries are generated */
+void daemon_index_icons()
+{
+	if (option.no_icon || icon_index.entries)
+		return;
+	index_icons();
+	find_icon(FALLBACK_ICON_PATH, option.fallback_icon);
+}
+
+int daemon_listen()
+{
+	int fd;
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+	if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", SOCKET_PATH) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path is too long: %s\n", SOCKET_PATH);
+		return -1;
+	}
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	/* a connectable socket means another daemon is serving already,
+	 * otherwise it is a leftover of a killed daemon */
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		fprintf(stderr, "Daemon is already running: %s\n", SOCKET_PATH);
+		close(fd);
+		return -1;
 	}
+	close(fd);
+	unlink(SOCKET_PATH);
 
-	list_insert(&icon_dirs, "/usr/share/pixmaps", SLEN);
-	for (List *idir = icon_dirs.next; idir; idir = idir->next) {
-		idir->fd = open(idir->text, O_RDONLY);
-		debug_msg("%d %s\n", idir->fd, idir->text);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+		fprintf(stderr, "Cannot listen on %s: %s\n", SOCKET_PATH, strerror(errno));
+		close(fd);
+		return -1;
 	}
-	/* This will restore the icon directories as in index.theme file,
-	 *   which results in fewer checks of file existance (-70% in my case!).
-	 * Reason: the "apps", "category" folder will be searched earlier */
-	list_reverse(&icon_dirs);
+	return fd;
 }
 
-void gen_entry(App *app)
+/* Scan everything from scratch, and (re)install the inotify watches */
+void daemon_load(int fd_inotify)
 {
-	char *perc, field, replace_str[LLEN] = {0};
-	char icon_path[MLEN] = {0}, buffer[MLEN] = {0};
-	char name[MLEN + 4] = {0}, command[MLEN + SLEN] = {0};
+	char path[MLEN] = {0};
+	const uint32_t dir_mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
 
-	if (app->terminal)
-		snprintf(command, sizeof(command), "%s -e %s", option.terminal, app->exec);
-	else
-		snprintf(command, sizeof(command), "%s", app->exec);
-
-	/* replace field codes */
-	/* search starting from right, this way the starting position stays the same */
-	while ((perc = strrchr(command, '%')) != NULL) {
-		field = *(perc + 1);
-		if (isalpha(field)) {
-			memset(replace_str, 0, MLEN);
-			if (field == 'c')
-				snprintf(replace_str, LLEN, "%s", app->entry_path);
-			else if (field == 'i' && strlen(app->icon) != 0)
-				snprintf(replace_str, LLEN, "--icon %s", app->icon);
-			else if (field == 'k')
-				snprintf(replace_str, LLEN, "%s", app->name);
-			snprintf(buffer, MLEN, "%s", perc + 2);
-			snprintf(perc, MLEN - (perc - command), "%s%s", replace_str, buffer);
-		}
-	}
-
-	if (!option.no_genname && strlen(app->genericname) > 0)
-		snprintf(name, sizeof(name), "%s (%s)", app->name, app->genericname);
-	else
-		strcpy(name, app->name);
+	for (List *w = app_watches.next; w; w = w->next)
+		inotify_rm_watch(fd_inotify, w->fd);
+	for (List *w = icon_watches.next; w; w = w->next)
+		inotify_rm_watch(fd_inotify, w->fd);
+	for (List *w = theme_watches.next; w; w = w->next)
+		inotify_rm_watch(fd_inotify, w->fd);
+	list_free(&app_watches);
+	list_free(&icon_watches);
+	list_free(&theme_watches);
+	close_icon_dirs();
+	free_all_apps();
+	arena_reset(&daemon_arena);
+	pool_reset(&daemon_pool);
+	daemon_stale_apps = 0;
+	daemon_dirty = (1u << LEN(category_icons)) - 1;
 
-	if (!option.no_icon)
-		find_icon(icon_path, app->icon);
+	if (!option.no_icon) {
+		find_icon_dirs();
+		index_icons();
+		find_icon(FALLBACK_ICON_PATH, option.fallback_icon);
+	}
+	find_all_apps();
 
-	if (option.no_icon || strlen(icon_path) == 0)
-		sprintf(app->xmenu_entry, "\t%s\t%s", name, command);
-	else
-		sprintf(app->xmenu_entry, "\tIMG:%s\t%s\t%s", icon_path, name, command);
+	/* a newly created applications folder needs a full reload */
+	for (List *dir = data_dirs_list.next; dir; dir = dir->next)
+		daemon_watch(fd_inotify, &theme_watches, dir->text, dir_mask);
+	for (List *folder = app_folders.next; folder; folder = folder->next)
+		daemon_watch(fd_inotify, &app_watches, folder->text,
+				dir_mask | IN_CLOSE_WRITE | IN_ATTRIB);
+	/* the folders of all index.theme files, of the inherited themes too */
+	for (List *file = theme_files.next; file; file = file->next) {
+		snprintf(path, MLEN, "%s", file->text);
+		*strrchr(path, '/') = '\0';
+		daemon_watch(fd_inotify, &theme_watches, path, dir_mask | IN_CLOSE_WRITE);
+	}
+	for (List *dir = icon_dirs.next; dir; dir = dir->next)
+		daemon_watch(fd_inotify, &icon_watches, dir->text, dir_mask);
 }
 
-/* getenv with fallback value */
-void getenv_fb(char *dest, char *name, char *fallback, int n)
+/* Render the changed categories again, and put the menu together from them */
+void daemon_render()
 {
-	char *env;
+	size_t bases[LEN(category_icons)];
 
-	if ((env = getenv(name))) {
-		snprintf(dest, n, "%s", env);
-	} else if (fallback) {
-		if (fallback[0] != '/')  /* relative path to $HOME */
-			snprintf(dest, n, "%s/%s", HOME, fallback);
-		else
-			snprintf(dest, n, "%s", fallback);
+	if (!daemon_dirty && daemon_menu.data)
+		return;
+	if (daemon_dirty) {
+		daemon_index_icons();
+		if (option.rasterize && !option.no_icon)
+			rasterize_icons();
+	}
+	for (int i = 0; i < LEN(category_icons); i++)
+		if (daemon_dirty & 1u << i)
+			daemon_render_category(i);
+	daemon_menu.len = 0;
+	for (int i = 0; i < LEN(category_icons); i++) {
+		bases[i] = daemon_menu.len;
+		if (daemon_fragments[i].len > 0)
+			buffer_append(&daemon_menu, daemon_fragments[i].data, daemon_fragments[i].len);
 	}
+	daemon_menu_len = daemon_menu.len;
+	xmenu_launch_table(&daemon_menu);
+	daemon_search = daemon_menu.len + sizeof(uint32_t);
+	search_index(&daemon_menu, bases);
+	if (daemon_search > daemon_menu.len)
+		daemon_search = 0;
+	debug_msg("Daemon menu rendered: %zu bytes\n", daemon_menu.len);
 }
 
-/*
- * handler for ini_parse
- * match subdirectories in an icon theme folder by parsing an index.theme file
- * - the icon size is options.icon_size
- * - the icon theme will be specified as the parsed the index.theme file
+/* Render a single category, only here the entries and icons of its apps are generated */
+void daemon_render_category(int category)
+{
+	size_t count = 0;
+	App **app_array;
+
+	daemon_index_icons();
+	for (App *app = all_apps.next; app; app = app->next)
+		count += app->category == category;
+	app_array = calloc(count + 1, sizeof(App *));
+	count = 0;
+	for (App *app = all_apps.next; app; app = app->next)
+		if (app->category == category)
+			app_array[count++] = app;
+
+	sort_apps(app_array, count);
+	daemon_fragments[category].len = 0;
+	xmenu_dump_category(&daemon_fragments[category], app_array, count);
+	daemon_dirty &= ~(1u << category);
+	free(app_array);
+}
+
+/* SIGTERM and SIGINT end the loop of daemon_run */
+void daemon_stop(int sig)
+{
+	daemon_stopped = 1;
+}
+
+/*
+ * Keep all apps and icon directories in memory, watch the folders with
+ * inotify, and serve the rendered menu to clients (see -c) over a UNIX
+ * socket. Only the desktop entries that changed are parsed again. SIGTERM
+ * and SIGINT are only let through while waiting, so the daemon always
+ * cleans up. Returns 0 after such a signal, 1 on an error.
+ */
+int daemon_run()
+{
+	int fd_inotify, fd_socket, ret = 0;
+	struct pollfd pfds[2];
+	struct sigaction action = {.sa_handler = daemon_stop}, old_term, old_int;
+	sigset_t stop_signals, wait_mask;
+
+	signal(SIGPIPE, SIG_IGN);
+	if ((fd_socket = daemon_listen()) < 0)
+		return 1;
+	if ((fd_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+		fprintf(stderr, "Cannot initialize inotify: %s\n", strerror(errno));
+		close(fd_socket);
+		return 1;
+	}
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGTERM);
+	sigaddset(&stop_signals, SIGINT);
+	sigprocmask(SIG_BLOCK, &stop_signals, &wait_mask);
+	daemon_stopped = 0;
+	sigaction(SIGTERM, &action, &old_term);
+	sigaction(SIGINT, &action, &old_int);
+
+	/* everything allocated from now on belongs to the daemon_arena */
+	arena = &daemon_arena;
+	pool = &daemon_pool;
+	daemon_load(fd_inotify);
+	pfds[0] = (struct pollfd){.fd = fd_inotify, .events = POLLIN};
+	pfds[1] = (struct pollfd){.fd = fd_socket, .events = POLLIN};
+	while (!daemon_stopped) {
+		if (ppoll(pfds, 2, NULL, &wait_mask) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Cannot wait for the daemon events: %s\n", strerror(errno));
+			ret = 1;
+			break;
+		}
+		if (pfds[0].revents & POLLIN)
+			daemon_update(fd_inotify);
+		if (pfds[1].revents & POLLIN)
+			daemon_serve(fd_socket);
+	}
+	debug_msg("Daemon stopping\n");
+	sigaction(SIGTERM, &old_term, NULL);
+	sigaction(SIGINT, &old_int, NULL);
+	sigprocmask(SIG_SETMASK, &wait_mask, NULL);
+
+	close(fd_inotify);
+	close(fd_socket);
+	unlink(SOCKET_PATH);
+	free(daemon_menu.data);
+	memset(&daemon_menu, 0, sizeof(Buffer));
+	for (int i = 0; i < LEN(category_icons); i++) {
+		free(daemon_fragments[i].data);
+		memset(&daemon_fragments[i], 0, sizeof(Buffer));
+	}
+	daemon_count_menus();
+	arena = &run_arena;
+	pool = &run_pool;
+	free_all_apps();
+	close_icon_dirs();
+	list_free(&app_watches);
+	list_free(&icon_watches);
+	list_free(&theme_watches);
+	arena_free(&daemon_arena);
+	pool_reset(&daemon_pool);
+	free(daemon_pool.data);
+	memset(&daemon_pool, 0, sizeof(Buffer));
+	return ret;
+}
+
+/*
+ * Answer a client, the requests are
+ * - "menu\n": the whole menu
+ * - "menu OPTIONS\n": the same, but nothing if OPTIONS are not the ones of
+ *   the daemon, see menu_options
+ * - "categories\n": the category lines only, the top level of the menu
+ * - "category NAME\n": the menu of one category, its apps are only looked
+ *   at now if the category changed
+ * - "search TEXT\n": the apps matching TEXT, see search_menu
+ */
+void daemon_serve(int fd_socket)
+{
+	int fd, category;
+	char request[LLEN + 8] = {0}, *eol, header[MLEN + SLEN] = {0}, options[LLEN];
+	struct timeval timeout = {.tv_sec = 1};
+	Buffer results = {0};
+
+	if ((fd = accept4(fd_socket, NULL, NULL, SOCK_CLOEXEC)) < 0)
+		return;
+	/* do not let a stuck client block the daemon */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	if (read(fd, request, sizeof(request) - 1) <= 0 || (eol = strchr(request, '\n')) == NULL) {
+		close(fd);
+		return;
+	}
+	*eol = '\0';
+
+	if (strcmp(request, "menu") == 0 || strncmp(request, "menu ", 5) == 0) {
+		menu_options(options, sizeof(options));
+		if (request[4] && strcmp(request + 5, options) != 0) {
+			debug_msg("Daemon options differ from the client's: %s\n", request + 5);
+		} else {
+			daemon_render();
+			write_all(fd, daemon_menu.data, daemon_menu.len);
+		}
+	} else if (strcmp(request, "categories") == 0) {
+		for (int i = 0; i < LEN(category_icons); i++)
+			for (App *app = all_apps.next; app; app = app->next)
+				if (app->category == i) {
+					if (!(category_icons_found & 1u << i))
+						daemon_index_icons();
+					xmenu_header(header, sizeof(header), i);
+					write_all(fd, header, strlen(header));
+					break;
+				}
+	} else if (strncmp(request, "category ", 9) == 0
+			&& (category = menu_category(request + 9)) != NO_CATEGORY) {
+		if (daemon_dirty & 1u << category)
+			daemon_render_category(category);
+		write_all(fd, daemon_fragments[category].data, daemon_fragments[category].len);
+	} else if (strncmp(request, "search ", 7) == 0) {
+		daemon_render();
+		if (daemon_search > 0)
+			search_menu(daemon_menu.data + daemon_search, daemon_menu.len - daemon_search,
+					daemon_menu.data, daemon_menu_len, request + 7, &results);
+		write_all(fd, results.data, results.len);
+		free(results.data);
+	}
+	close(fd);
+	if (option.low_memory)
+		daemon_drop();
+	daemon_count_menus();
+}
+
+void daemon_update(int fd_inotify)
+{
+	int reload = 0, icons_changed = 0;
+	size_t live_apps = 0;
+	char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	char path[LLEN] = {0};
+	ssize_t len;
+	List *watch;
+	struct inotify_event *ev;
+
+	/* a changed desktop entry might come with a newly installed program */
+	index_path();
+	while ((len = read(fd_inotify, buffer, sizeof(buffer))) > 0) {
+		for (char *p = buffer; p < buffer + len; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				reload = 1;
+			} else if ((watch = list_find_fd(&app_watches, ev->wd))) {
+				/* a new or removed subfolder changes the desktop IDs */
+				if (ev->mask & IN_ISDIR) {
+					reload = 1;
+				} else if (ev->len > 0 && check_file_ext(ev->name, ".desktop")) {
+					snprintf(path, LLEN, "%s/%s", watch->text, ev->name);
+					daemon_update_app(path);
+				}
+			} else if (list_find_fd(&icon_watches, ev->wd)) {
+				icons_changed = 1;
+			} else if (list_find_fd(&theme_watches, ev->wd) && ev->len > 0 &&
+					(strcmp(ev->name, "applications") == 0
+					 || strcmp(ev->name, "index.theme") == 0)) {
+				reload = 1;
+			}
+		}
+	}
+
+	/* removed apps still take memory, reclaim it once they outnumber the live ones */
+	for (App *app = all_apps.next; app; app = app->next)
+		live_apps++;
+	if (daemon_stale_apps > 64 && daemon_stale_apps > live_apps)
+		reload = 1;
+
+	if (reload) {
+		debug_msg("Daemon reloading everything\n");
+		daemon_load(fd_inotify);
+	} else if (icons_changed && !option.no_icon) {
+		/* icon directories are still the same, only look the icons up again */
+		debug_msg("Daemon looking up icons again\n");
+		index_icons();
+		find_icon(FALLBACK_ICON_PATH, option.fallback_icon);
+		for (App *app = all_apps.next; app; app = app->next)
+			app->xmenu_entry = 0;
+		daemon_dirty = (1u << LEN(category_icons)) - 1;
+	}
+}
+
+/*
+ * Parse a desktop entry again, after it was added, changed or removed. The
+ * app of its desktop ID is replaced by the entry that find_all_apps would
+ * pick for it, which need not be the changed one: it can be in another
+ * folder, or be sub-app.desktop for sub/app.desktop.
+ */
+void daemon_update_app(const char *path)
+{
+	char id[LLEN], app_id[LLEN], folder[MLEN + 16], winner[LLEN] = {0};
+	App *app, *prev;
+
+	debug_msg("Daemon updating app: %s\n", path);
+	if (!desktop_id(path, id))
+		return;
+	for (prev = &all_apps; (app = prev->next); ) {
+		if (desktop_id(STR(app->entry_path), app_id) && strcmp(app_id, id) == 0) {
+			prev->next = app->next;
+			daemon_dirty |= 1u << app->category;
+			daemon_stale_apps++;
+		} else {
+			prev = app;
+		}
+	}
+	for (List *dir = data_dirs_list.next; dir; dir = dir->next) {
+		snprintf(folder, sizeof(folder), "%s/applications", dir->text);
+		if (find_desktop_entry(folder, "", id, winner))
+			break;
+	}
+	if (winner[0] && (app = parse_app(winner)) != NULL) {
+		app->next = all_apps.next;
+		all_apps.next = app;
+		daemon_dirty |= 1u << app->category;
+	}
+}
+
+void daemon_watch(int fd_inotify, List *watches, const char *path, uint32_t mask)
+{
+	int wd;
+
+	if ((wd = inotify_add_watch(fd_inotify, path, mask | IN_ONLYDIR)) < 0)
+		return;
+	list_insert(watches, (char *)path, MLEN);
+	watches->next->fd = wd;
+}
+
+void debug_msg(const char *msg, ...)
+{	
+	if (!option.debug)
+		return;
+
+	va_list args;
+	fprintf(stderr, "DEBUG: ");
+	va_start(args, msg);
+	vfprintf(stderr, msg, args);
+	va_end(args);
+}
+
+/* Get the desktop ID of an entry in one of the applications folders, 0 outside of them */
+int desktop_id(const char *path, char *id)
+{
+	size_t len;
+
+	for (List *dir = data_dirs_list.next; dir; dir = dir->next) {
+		len = strlen(dir->text);
+		if (strncmp(path, dir->text, len) != 0 || strncmp(path + len, "/applications/", 14) != 0)
+			continue;
+		path += len + 14;
+		snprintf(id, LLEN, "%s", path);
+		for (char *p = id; (p = strchr(p, '/')); )
+			*p = '-';
+		return 1;
+	}
+	return 0;
+}
+
+/* Append an argument to a command line, quoted like in an Exec key if needed */
+void exec_quote(Buffer *buffer, const char *arg)
+{
+	if (*arg && strpbrk(arg, " \t\n\"'\\><~|&;$*?#()`") == NULL) {
+		buffer_append(buffer, arg, strlen(arg));
+		return;
+	}
+	buffer_append(buffer, "\"", 1);
+	for (; *arg; arg++) {
+		if (strchr("\"`$\\", *arg))
+			buffer_append(buffer, "\\", 1);
+		/* a line of the menu cannot hold a newline */
+		buffer_append(buffer, *arg == '\n' ? " " : arg, 1);
+	}
+	buffer_append(buffer, "\"", 1);
+}
+
+/*
+ * Split an Exec value into arguments, by the quoting rules of the desktop
+ * entry spec, and expand the field codes of app. Each argument is appended
+ * to argv with a terminating NUL, the number of arguments is returned.
+ * Without an app, e.g. for a command returned by xmenu, the value is not
+ * unescaped as a string and % is not special.
+ */
+int exec_split(const char *exec, const App *app, Buffer *argv)
+{
+	int count = 0, quoted, keep;
+	char *value, *p;
+	const char *field;
+	size_t start;
+	Buffer unescaped = {0};
+
+	/* the escapes of string values come first, \s, \n, \t, \r and \\ */
+	buffer_append(&unescaped, "", 0);
+	for (; *exec; exec++) {
+		if (app && exec[0] == '\\' && exec[1] && strchr("sntr\\", exec[1])) {
+			exec++;
+			buffer_append(&unescaped, *exec == 's' ? " " : *exec == 'n' ? "\n"
+					: *exec == 't' ? "\t" : *exec == 'r' ? "\r" : "\\", 1);
+		} else {
+			buffer_append(&unescaped, exec, 1);
+		}
+	}
+
+	for (p = unescaped.data; *p; ) {
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (!*p)
+			break;
+		/* %i standing alone expands to two arguments */
+		if (app && p[0] == '%' && p[1] == 'i' && (!p[2] || p[2] == ' ' || p[2] == '\t')) {
+			if (app->icon) {
+				buffer_append(argv, "--icon", 7);
+				buffer_append(argv, STR(app->icon), strlen(STR(app->icon)) + 1);
+				count += 2;
+			}
+			p += 2;
+			continue;
+		}
+
+		start = argv->len;
+		quoted = keep = 0;
+		for (; *p && (quoted || (*p != ' ' && *p != '\t')); p++) {
+			if (*p == '"') {
+				quoted = !quoted;
+				keep = 1;  /* even if empty */
+			} else if (quoted && *p == '\\' && p[1] && strchr("\"`$\\", p[1])) {
+				buffer_append(argv, ++p, 1);
+			} else if (app && *p == '%' && p[1]) {
+				field = ++p;
+				value = *field == 'c' ? (char *)STR(app->name)
+					: *field == 'k' ? (char *)STR(app->entry_path)
+					: *field == '%' ? "%" : "";
+				/* not a field code, keep it */
+				if (!isalpha((unsigned char)*field) && *field != '%')
+					buffer_append(argv, field - 1, 2);
+				buffer_append(argv, value, strlen(value));
+			} else {
+				buffer_append(argv, p, 1);
+				keep = 1;
+			}
+		}
+		/* an argument of removed field codes only, like %U, is dropped */
+		if (argv->len == start && !keep)
+			continue;
+		buffer_append(argv, "", 1);
+		count++;
+	}
+	free(unescaped.data);
+	return count;
+}
+
+/* Return the menu category of the last known category, or NO_CATEGORY */
+int extract_main_category(const char *categories)
+{
+	int category = NO_CATEGORY;
+	char name[SLEN];
+	size_t len;
+	struct Category2Name *match;
+
+	for (const char *p = categories; *p; p += len + (p[len] == ';')) {
+		len = strcspn(p, ";");
+		if (len == 0 || len >= SLEN)
+			continue;
+		memcpy(name, p, len);
+		name[len] = '\0';
+		if ((match = bsearch(name, xdg_categories, LEN(xdg_categories),
+				sizeof(xdg_categories[0]), cmp_category)) != NULL)
+			category = match->menu;
+	}
+	return category;
+}
+
+/*
+ * Collect all desktop entries first, then parse them with option.jobs
+ * threads. Everything shared (icon_index, path_list, option, ...) is only
+ * read while the threads are running. Each entry has its own slot in
+ * job.apps, so the resulting list does not depend on the thread timing.
+ * The folders are walked in the order of priority, so an entry that is
+ * shadowed by one with the same desktop ID is skipped unread, even if the
+ * winner is hidden or invalid.
+ */
+void find_all_apps()
+{
+	int jobs;
+	char folder[MLEN + 16] = {0};
+	pthread_t *threads;
+	HashTable ids = {.kind = XDGMENU_MEM_APPS};
+	Bucket *bucket;
+	ParseJob job = {0};
+
+	list_free(&app_folders);
+	for (List *data_dir = data_dirs_list.next; data_dir; data_dir = data_dir->next) {
+		snprintf(folder, sizeof(folder), "%s/applications", data_dir->text);
+		collect_apps(&job, &ids, folder, "");
+	}
+	list_reverse(&app_folders);
+	hash_free(&ids);
+
+	index_path();
+
+	/* no more threads than batches of work */
+	jobs = option.jobs > 0 ? option.jobs : sysconf(_SC_NPROCESSORS_ONLN);
+	if (jobs > (job.count + BATCH - 1) / BATCH)
+		jobs = (job.count + BATCH - 1) / BATCH;
+	debug_msg("Parsing %zu desktop entries with %d threads\n", job.count, jobs);
+
+	job.apps = calloc(job.count + 1, sizeof(App *));
+	job.arena = arena;
+	job.pool = pool;
+	pthread_mutex_init(&job.lock, NULL);
+	threads = calloc(jobs + 1, sizeof(pthread_t));
+	/* the current thread is the first worker */
+	for (int i = 1; i < jobs; i++)
+		if (pthread_create(&threads[i], NULL, parse_worker, &job) != 0)
+			threads[i] = 0;
+	parse_worker(&job);
+	for (int i = 1; i < jobs; i++)
+		if (threads[i])
+			pthread_join(threads[i], NULL);
+
+	/* put the apps into the buckets of their categories right away */
+	for (size_t i = 0; i < job.count; i++)
+		if (job.apps[i])
+			app_buckets[job.apps[i]->category].count++;
+	for (int i = 0; i < LEN(app_buckets); i++) {
+		app_buckets[i].apps = arena_alloc(arena, app_buckets[i].count * sizeof(App *), XDGMENU_MEM_APPS);
+		app_buckets[i].count = 0;
+	}
+	for (size_t i = 0; i < job.count; i++) {
+		if (job.apps[i]) {
+			job.apps[i]->next = all_apps.next;
+			all_apps.next = job.apps[i];
+			bucket = &app_buckets[job.apps[i]->category];
+			bucket->apps[bucket->count++] = job.apps[i];
+		}
+		free(job.paths[i]);
+	}
+	pthread_mutex_destroy(&job.lock);
+	free(threads);
+	free(job.apps);
+	free(job.paths);
+}
+
+/*
+ * Find the entry of desktop ID id in an applications folder, in the order
+ * collect_apps walks it, so the same one wins. Only the subfolders that
+ * the ID starts with are read. Returns 1 with its path copied to path.
+ */
+int find_desktop_entry(const char *folder, const char *prefix, const char *id, char *path)
+{
+	int found = 0;
+	char name[LLEN], sub[LLEN];
+	DIR *dir;
+	struct dirent *entry;
+	struct stat sb;
+
+	COUNT(open);
+	if ((dir = opendir(folder)) == NULL)
+		return 0;
+	while (!found && (entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.')
+			continue;
+		snprintf(name, LLEN, "%s/%s", folder, entry->d_name);
+		snprintf(sub, LLEN, "%s%s-", prefix, entry->d_name);
+		if (entry->d_type == DT_DIR || (entry->d_type == DT_UNKNOWN
+				&& !check_file_ext(entry->d_name, ".desktop")
+				&& COUNT(stat) && stat(name, &sb) == 0 && S_ISDIR(sb.st_mode))) {
+			if (strncmp(id, sub, strlen(sub)) == 0)
+				found = find_desktop_entry(name, sub, id, path);
+			continue;
+		}
+		/* the ID of a file is its prefix and name */
+		sub[strlen(sub) - 1] = '\0';
+		if ((entry->d_type == DT_REG || entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN)
+			&& strcmp(sub, id) == 0 && check_file_ext(entry->d_name, ".desktop")) {
+			snprintf(path, LLEN, "%s", name);
+			found = 1;
+		}
+	}
+	closedir(dir);
+	return found;
+}
+
+void find_icon(char *icon_path, char *icon_name)
+{
+	HashEntry *match;
+
+	/* provided icon is a file path */
+	if (icon_name[0] == '/') {
+		COUNT(access);
+		snprintf(icon_path, MLEN, "%s", access(icon_name, F_OK) == 0 ?
+				 icon_name : FALLBACK_ICON_PATH);
+		return;
+	}
+
+	/* a path too long for icon_path falls back too */
+	if ((match = hash_find(&icon_index, icon_name, strlen(icon_name))) != NULL
+		&& snprintf(icon_path, MLEN, "%s/%s.%s", ((List *)match->value)->text,
+				icon_name, icon_exts[match->data]) < MLEN)
+		return;
+	snprintf(icon_path, MLEN, "%s", FALLBACK_ICON_PATH);
+}
+
+/*
+ * Find the icon directories matching the icon size and scale, in the order
+ * of lookup: the directories of the icon theme, then of the themes it
+ * inherits, depth first, and then of hicolor, the fallback of all themes.
+ * The result is cached, as long as none of the index.theme files changes.
+ */
+void find_icon_dirs()
+{
+	List visited = {0};
+
+	snprintf(THEME_CACHE_FILE, MLEN, "%s/icons-%s-%d@%d", CACHE_DIR,
+			option.icon_theme, option.icon_size, option.scale);
+	if (!option.no_cache && load_theme_cache())
+		return;
+
+	find_theme_dirs(option.icon_theme, &visited);
+	find_theme_dirs("hicolor", &visited);
+	list_insert(&icon_dirs, "/usr/share/pixmaps", MLEN);
+	/* restore the order of lookup, the lists were built by prepending */
+	list_reverse(&icon_dirs);
+	list_reverse(&theme_files);
+	if (!option.no_cache)
+		save_theme_cache();
+}
+
+/* Add the directories of an icon theme and its parents to icon_dirs */
+void find_theme_dirs(const char *theme, List *visited)
+{
+	int res, parsed = 0;
+	char path[MLEN] = {0}, *parent, *saveptr;
+	ThemeIndex index = {0};
+
+	for (List *v = visited->next; v; v = v->next)
+		if (strcmp(v->text, theme) == 0)
+			return;
+	list_insert(visited, (char *)theme, MLEN);
+
+	/* the first index.theme found describes the theme, remember the
+	 * others anyway, a new one would take over */
+	for (List *dir = data_dirs_list.next; dir; dir = dir->next) {
+		if (snprintf(path, MLEN, "%s/icons/%s/index.theme", dir->text, theme) >= MLEN)
+			continue;
+		list_insert(&theme_files, path, MLEN);
+		if (!parsed && COUNT(access) && access(path, F_OK) == 0) {
+			debug_msg("Ini parse icon theme: %s\n", path);
+			if ((res = ini_parse(path, handler_icon_dirs_theme, &index)) > 0)
+				debug_msg("%s parse failed: %d\n", path, res);
+			/* mannually call, a hack to process the end of file */
+			handler_icon_dirs_theme(&index, "", NULL, NULL);
+			parsed = 1;
+		}
+	}
+	if (!parsed)
+		return;
+
+	/* the subdirectory is looked up in every base directory */
+	list_reverse(&index.subdirs);
+	for (List *subdir = index.subdirs.next; subdir; subdir = subdir->next)
+		for (List *dir = data_dirs_list.next; dir; dir = dir->next) {
+			if (snprintf(path, MLEN, "%s/icons/%s/%s", dir->text, theme, subdir->text) < MLEN)
+				list_insert(&icon_dirs, path, MLEN);
+		}
+
+	for (parent = strtok_r(index.inherits, ", \t", &saveptr); parent;
+		 parent = strtok_r(NULL, ", \t", &saveptr))
+		find_theme_dirs(parent, visited);
+}
+
+/* Modification time in nanoseconds, -1 if the file does not exist */
+int64_t file_mtime(const char *path)
+{
+	struct stat sb;
+
+	COUNT(stat);
+	if (stat(path, &sb) != 0)
+		return -1;
+	return (int64_t)sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec;
+}
+
+/*
+ * Generate the line of an app in the menu, and its launch record: a uint32
+ * length, then the command as in the line, the working directory and the
+ * arguments, each terminated by a NUL. launch then neither splits the
+ * command again nor looks for its directory. With actions, the line opens
+ * a submenu of the app itself and its actions, and each action gets a
+ * record after the app's one. There is no limit on the length of a line.
+ */
+void gen_entry(App *app)
+{
+	char icon_path[MLEN] = {0}, action_icon[MLEN], *path;
+	const char *action, *exec, *icon;
+	Buffer entry = {0}, record = {0}, submenu = {0};
+
+	int64_t start = option.timing ? clock_ns(CLOCK_MONOTONIC) : 0;
+
+	if (!option.no_icon)
+		find_icon(icon_path, (char *)STR(app->icon));
+	if (option.rasterize)
+		raster_icon(icon_path);
+	if (option.timing)
+		__atomic_add_fetch(&stats.icon_ns, clock_ns(CLOCK_MONOTONIC) - start, __ATOMIC_RELAXED);
+	if (option.no_icon || strlen(icon_path) == 0) {
+		buffer_append(&entry, "\t", 1);
+	} else {
+		buffer_append(&entry, "\tIMG:", 5);
+		buffer_append(&entry, icon_path, strlen(icon_path));
+		buffer_append(&entry, "\t", 1);
+	}
+
+	buffer_append(&entry, STR(app->name), strlen(STR(app->name)));
+	if (!option.no_genname && app->genericname) {
+		buffer_append(&entry, " (", 2);
+		buffer_append(&entry, STR(app->genericname), strlen(STR(app->genericname)));
+		buffer_append(&entry, ")", 1);
+	}
+	buffer_append(&entry, "\t", 1);
+	gen_launch(app, STR(app->exec), &entry, &record);
+
+	/* an item with a submenu cannot be chosen in xmenu, so the app comes first in it */
+	if (app->nactions > 0) {
+		buffer_append(&submenu, "\n\t", 2);
+		buffer_append(&submenu, entry.data, entry.len);
+	}
+	for (action = STR(app->actions); *action; action = icon + strlen(icon) + 1) {
+		exec = action + strlen(action) + 1;
+		icon = exec + strlen(exec) + 1;
+		path = icon_path;
+		if (!option.no_icon && *icon) {
+			action_icon[0] = '\0';
+			find_icon(action_icon, (char *)icon);
+			if (option.rasterize)
+				raster_icon(action_icon);
+			if (strlen(action_icon) > 0)
+				path = action_icon;
+		}
+		if (option.no_icon || strlen(path) == 0) {
+			buffer_append(&submenu, "\n\t\t", 3);
+		} else {
+			buffer_append(&submenu, "\n\t\tIMG:", 7);
+			buffer_append(&submenu, path, strlen(path));
+			buffer_append(&submenu, "\t", 1);
+		}
+		buffer_append(&submenu, action, strlen(action));
+		buffer_append(&submenu, "\t", 1);
+		gen_launch(app, exec, &submenu, &record);
+	}
+	if (submenu.len > 0)
+		buffer_append(&entry, submenu.data, submenu.len);
+
+	app->xmenu_entry = pool_add(pool, entry.data, entry.len);
+	app->launch_record = pool_add(pool, record.data, record.len);
+	free(entry.data);
+	free(record.data);
+	free(submenu.data);
+}
+
+/*
+ * Append the command of an Exec value of app to entry, and its launch
+ * record to record, see gen_entry. Terminal apps run in option.terminal.
+ */
+void gen_launch(const App *app, const char *exec, Buffer *entry, Buffer *record)
+{
+	int argc;
+	char *arg;
+	size_t command = entry->len, start = record->len;
+	uint32_t len = 0;
+	Buffer argv = {0};
+
+	if (app->terminal) {
+		buffer_append(entry, option.terminal, strlen(option.terminal));
+		buffer_append(entry, " -e ", 4);
+	}
+	/* the command is the Exec key with its field codes expanded, quoted
+	 * again so that exec_split gets back the same arguments */
+	argc = exec_split(exec, app, &argv);
+	for (arg = argv.data; argc-- > 0; arg += strlen(arg) + 1) {
+		exec_quote(entry, arg);
+		if (argc > 0)
+			buffer_append(entry, " ", 1);
+	}
+
+	buffer_append(record, (char *)&len, sizeof(len));
+	buffer_append(record, entry->data + command, entry->len - command);
+	buffer_append(record, "", 1);
+	buffer_append(record, STR(app->path), strlen(STR(app->path)) + 1);
+	if (app->terminal) {
+		exec_split(option.terminal, NULL, record);
+		buffer_append(record, "-e", 3);
+	}
+	buffer_append(record, argv.data, argv.len);
+	len = record->len - start - sizeof(len);
+	memcpy(record->data + start, &len, sizeof(len));
+	free(argv.data);
+}
+
+/* getenv with fallback value */
+void getenv_fb(char *dest, char *name, char *fallback, int n)
+{
+	char *env;
+
+	if ((env = getenv(name))) {
+		snprintf(dest, n, "%s", env);
+	} else if (fallback) {
+		if (fallback[0] != '/')  /* relative path to $HOME */
+			snprintf(dest, n, "%s/%s", HOME, fallback);
+		else
+			snprintf(dest, n, "%s", fallback);
+	}
+}
+
+/*
+ * handler for ini_parse
+ * match subdirectories in an icon theme folder by parsing an index.theme file
+ * - the icon size is options.icon_size
+ * - the matched subdirectories and the Inherits key are saved in *user,
+ *   which is a ThemeIndex
  */
 int handler_icon_dirs_theme(void *user, const char *section, const char *name, const char *value)
 {
 	/* static variables to preserve between function calls */
-	static char subdir[32], type[16];
+	static char subdir[MLEN], type[16];
 	static int size, minsize, maxsize, threshold, scale;
+	ThemeIndex *index = (ThemeIndex *)user;
 
 	if ((!name && !value) || strcmp(section, subdir) != 0) {
 		/* Check the icon size after finished parsing a section */
@@ -430,10 +1995,10 @@ int handler_icon_dirs_theme(void *user, const char *section, const char *name, c
 					&& minsize <= option.icon_size
 					&& maxsize >= option.icon_size)))
 			/* save dirs into this linked list */
-			list_insert(&icon_dirs, subdir, SLEN);
+			list_insert(&index->subdirs, subdir, MLEN);
 
 		/* reset the current section */
-		snprintf(subdir, 32, "%s", section);
+		snprintf(subdir, MLEN, "%s", section);
 		size = minsize = maxsize = -1;
 		threshold = 2;  /* threshold fallback value */
 		scale = 1;
@@ -459,167 +2024,1758 @@ int handler_icon_dirs_theme(void *user, const char *section, const char *name, c
 		scale = atoi(value);
 	} else if (strcmp(name, "Type") == 0) {
 		snprintf(type, 16, "%s", value);
+	} else if (strcmp(name, "Inherits") == 0 && strcmp(section, "Icon Theme") == 0) {
+		snprintf(index->inherits, MLEN, "%s", value);
 	}
 
-	return 1;
+	return 1;
+}
+
+int handler_set_icon_theme(void *user, const char *section, const char *name, const char *value)
+{
+	if (strcmp(section, "Settings") == 0 && strcmp(name, "gtk-icon-theme-name") == 0)
+		strcpy(FALLBACK_ICON_THEME, value);
+	return 1;
+}
+
+/* The memory is owned by the arena, only forget the apps here */
+void free_all_apps()
+{
+	all_apps.next = NULL;
+	memset(app_buckets, 0, sizeof(app_buckets));
+}
+
+/*
+ * Sort the apps of every category by their usage, as loaded by usage_load,
+ * and add the most used ones to the Recent category on top. The menu is otherwise
+ * unchanged, so this works on a cached menu or one from the daemon too.
+ * An app is a line with one leading tab, followed by its submenu lines.
+ */
+void frecency_sort(char **menu, size_t *len)
+{
+	int count = 0, recent = 0, start, end;
+	const char *line, *eol, *command, *end_command, *end_menu = *menu + *len;
+	const char *recent_header = "Recent\n";
+	size_t recent_len = 7;
+	MenuItem *items;
+	Buffer sorted = {0};
+
+	if (usage_count == 0) {
+		/* nothing to sort, only drop the empty Recent header of xmenu_dump */
+		if (*len > 0 && (eol = memchr(*menu, '\n', *len)) != NULL && **menu != '\t'
+			&& eol - *menu >= 6 && memcmp(eol - 6, "Recent", 6) == 0) {
+			*len -= eol + 1 - *menu;
+			memmove(*menu, eol + 1, *len + 1);
+		}
+		return;
+	}
+
+	/* split into categories and apps, items of a category follow its header */
+	items = calloc(*len / 2 + 2, sizeof(MenuItem));
+	for (line = *menu; line < end_menu; line = eol) {
+		eol = memchr(line, '\n', end_menu - line);
+		eol = eol ? eol + 1 : end_menu;
+		if (line[0] == '\t' && line[1] == '\t' && count > 0) {
+			items[count - 1].len = eol - items[count - 1].text;
+			continue;
+		}
+		if (line[0] != '\t' && eol - line >= 7 && memcmp(eol - 7, "Recent\n", 7) == 0) {
+			/* the Recent header with its icon, written by xmenu_dump */
+			recent_header = line;
+			recent_len = eol - line;
+			continue;
+		}
+		items[count] = (MenuItem){.text = line, .len = eol - line, .order = count};
+		if (line[0] == '\t') {
+			/* the command is the last field of the app's line */
+			end_command = eol[-1] == '\n' ? eol - 1 : eol;
+			for (command = end_command; command > line && command[-1] != '\t'; command--)
+				;
+			items[count].score = usage_score(command, end_command - command);
+			recent += items[count].score > 0;
+		}
+		count++;
+	}
+
+	if (recent > 0) {
+		MenuItem *top = calloc(count, sizeof(MenuItem));
+		int ntop = 0;
+
+		for (int i = 0; i < count; i++)
+			if (items[i].text[0] == '\t' && items[i].score > 0)
+				top[ntop++] = items[i];
+		qsort(top, ntop, sizeof(MenuItem), cmp_menu_item);
+		buffer_append(&sorted, recent_header, recent_len);
+		for (int i = 0; i < ntop && i < RECENT_COUNT; i++) {
+			buffer_append(&sorted, top[i].text, top[i].len);
+			if (top[i].text[top[i].len - 1] != '\n')
+				buffer_append(&sorted, "\n", 1);
+		}
+		free(top);
+	}
+	for (start = 0; start < count; start = end) {
+		/* a header, then its apps */
+		for (end = start + 1; end < count && items[end].text[0] == '\t'; end++)
+			;
+		qsort(items + start + 1, end - start - 1, sizeof(MenuItem), cmp_menu_item);
+		for (int i = start; i < end; i++) {
+			buffer_append(&sorted, items[i].text, items[i].len);
+			if (items[i].text[items[i].len - 1] != '\n')
+				buffer_append(&sorted, "\n", 1);
+		}
+	}
+
+	free(items);
+	free(*menu);
+	*menu = sorted.data;
+	*len = sorted.len;
+}
+
+HashEntry *hash_find(HashTable *table, const char *key, size_t len)
+{
+	HashEntry *entry;
+
+	if (table->size == 0)
+		return NULL;
+	for (size_t i = hash_str(key, len) & (table->size - 1); ; i = (i + 1) & (table->size - 1)) {
+		entry = &table->entries[i];
+		if (!entry->key)
+			return NULL;
+		if (strncmp(entry->key, key, len) == 0 && entry->key[len] == '\0')
+			return entry;
+	}
+}
+
+void hash_free(HashTable *table)
+{
+	int kind = table->kind;
+	ssize_t bytes = table->size * sizeof(HashEntry);
+
+	for (size_t i = 0; i < table->size; i++) {
+		if (table->entries[i].key)
+			bytes += strlen(table->entries[i].key) + 1;
+		free(table->entries[i].key);
+	}
+	free(table->entries);
+	mem_add(kind, -bytes);
+	memset(table, 0, sizeof(HashTable));
+	table->kind = kind;
+}
+
+/* Return the entry of key, a new entry has its value set to NULL */
+HashEntry *hash_insert(HashTable *table, const char *key, size_t len)
+{
+	size_t i;
+	HashEntry *entry, *old_entries = table->entries, *old_end;
+
+	if ((entry = hash_find(table, key, len)) != NULL)
+		return entry;
+
+	/* keep the load factor under 1/2 */
+	if (2 * (table->count + 1) > table->size) {
+		old_end = old_entries + table->size;
+		table->size = table->size ? table->size * 2 : 64;
+		table->entries = calloc(table->size, sizeof(HashEntry));
+		mem_add(table->kind, (table->size - (old_end - old_entries)) * sizeof(HashEntry));
+		for (HashEntry *e = old_entries; e < old_end; e++) {
+			if (!e->key)
+				continue;
+			for (i = hash_str(e->key, strlen(e->key)) & (table->size - 1);
+				 table->entries[i].key; i = (i + 1) & (table->size - 1))
+				;
+			table->entries[i] = *e;
+		}
+		free(old_entries);
+	}
+
+	for (i = hash_str(key, len) & (table->size - 1);
+		 table->entries[i].key; i = (i + 1) & (table->size - 1))
+		;
+	entry = &table->entries[i];
+	entry->key = strndup(key, len);
+	mem_add(table->kind, strlen(entry->key) + 1);
+	table->count++;
+	return entry;
+}
+
+/* FNV-1a */
+uint32_t hash_str(const char *key, size_t len)
+{
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char)key[i]) * 16777619u;
+	return hash;
+}
+
+/*
+ * Read every icon directory once with getdents64 and remember the best
+ * match of each icon name: the first directory in icon_dirs that has it,
+ * and in that directory the first extension in icon_exts.
+ * After this, looking up an icon does not need any system call.
+ */
+void index_icons()
+{
+	int fd, ext;
+	char buffer[32768], *dot;
+	ssize_t n;
+	struct dirent64 *entry;
+	HashEntry *match;
+
+	hash_free(&icon_index);
+	hash_free(&raster_index);
+	category_icons_found = 0;
+	for (List *dir = icon_dirs.next; dir; dir = dir->next) {
+		COUNT(open);
+		if ((fd = open(dir->text, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+			continue;
+		while ((n = getdents64(fd, buffer, sizeof(buffer))) > 0) {
+			for (char *p = buffer; p < buffer + n; p += entry->d_reclen) {
+				entry = (struct dirent64 *)p;
+				if ((entry->d_type != DT_REG
+						&& entry->d_type != DT_LNK
+						&& entry->d_type != DT_UNKNOWN)
+					|| (dot = strrchr(entry->d_name, '.')) == NULL)
+					continue;
+				for (ext = 0; ext < LEN(icon_exts); ext++)
+					if (strcmp(dot + 1, icon_exts[ext]) == 0)
+						break;
+				if (ext == LEN(icon_exts))
+					continue;
+
+				match = hash_insert(&icon_index, entry->d_name, dot - entry->d_name);
+				if (!match->value || (match->value == dir && ext < match->data)) {
+					match->value = dir;
+					match->data = ext;
+				}
+			}
+		}
+		close(fd);
+	}
+	debug_msg("Indexed %zu icons\n", icon_index.count);
+}
+
+/* Read the $PATH directories once, this replaces a stat per directory and TryExec */
+void index_path()
+{
+	DIR *dir;
+	struct dirent *entry;
+	HashEntry *match;
+
+	hash_free(&path_index);
+	for (List *path = path_list.next; path; path = path->next) {
+		COUNT(open);
+		if ((dir = opendir(path->text)) == NULL)
+			continue;
+		while ((entry = readdir(dir)) != NULL) {
+			if (entry->d_type != DT_REG
+				&& entry->d_type != DT_LNK
+				&& entry->d_type != DT_UNKNOWN)
+				continue;
+			match = hash_insert(&path_index, entry->d_name, strlen(entry->d_name));
+			if (!match->value)
+				match->value = path;
+		}
+		closedir(dir);
+	}
+	debug_msg("Indexed %zu files in PATH\n", path_index.count);
+}
+
+/*
+ * Start a command returned by xmenu in a new session, without a shell. The
+ * arguments and the directory of its Path key come from its launch record,
+ * see menu_split, a command that is not in the menu is split here. Children
+ * of earlier calls that exited are reaped here, for processes that call
+ * xdgmenu repeatedly, launched holds the pids of all of them. A wait for
+ * any child would take the rsvg-convert and xmenu ones of a refresh too.
+ * debug is the -d of the context, the global option is the one of the
+ * current refresh.
+ */
+void launch(const char *command, HashTable *commands, Buffer *launched, int debug)
+{
+	int argc = 0, err;
+	char **argv, *arg, *end, *dir = "";
+	pid_t pid, *pids = (pid_t *)launched->data;
+	size_t kept = 0;
+	Buffer args = {0};
+	HashEntry *entry;
+	posix_spawnattr_t attr;
+	posix_spawn_file_actions_t actions;
+
+	for (size_t i = 0; i < launched->len / sizeof(pid_t); i++)
+		if (waitpid(pids[i], NULL, WNOHANG) == 0)
+			pids[kept++] = pids[i];
+	launched->len = kept * sizeof(pid_t);
+	if ((entry = hash_find(commands, command, strlen(command))) != NULL) {
+		/* the record is checked by menu_split */
+		uint32_t len;
+
+		memcpy(&len, entry->value, sizeof(len));
+		end = (char *)entry->value + sizeof(len) + len;
+		dir = (char *)entry->value + sizeof(len) + strlen(command) + 1;
+		arg = dir + strlen(dir) + 1;
+		for (char *p = arg; p < end; p += strlen(p) + 1)
+			argc++;
+	} else {
+		argc = exec_split(command, NULL, &args);
+		arg = args.data;
+	}
+	if (argc == 0) {
+		free(args.data);
+		return;
+	}
+	argv = calloc(argc + 1, sizeof(char *));
+	for (int i = 0; i < argc; i++, arg += strlen(arg) + 1)
+		argv[i] = arg;
+
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID);
+	posix_spawn_file_actions_init(&actions);
+	if (*dir) {
+		if (debug)
+			fprintf(stderr, "DEBUG: Launch in %s\n", dir);
+		posix_spawn_file_actions_addchdir_np(&actions, dir);
+	}
+
+	if ((err = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ)) != 0)
+		fprintf(stderr, "Cannot run %s: %s\n", argv[0], strerror(err));
+	else
+		buffer_append(launched, (char *)&pid, sizeof(pid));
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	free(argv);
+	free(args.data);
+}
+
+/*
+ * Load icon_dirs and theme_files from THEME_CACHE_FILE, if no index.theme
+ * changed since. The file is read with a single read, its format is
+ * - the header line, see save_theme_cache
+ * - uint32 count, then count times: uint16 length, path, int64 mtime (ns)
+ *   of all index.theme files in theme_files
+ * - uint32 count, then count times: uint16 length, path of the icon_dirs
+ */
+int load_theme_cache()
+{
+	int fd, ok = 0, header_len;
+	char header[LLEN + MLEN + SLEN] = {0}, path[MLEN] = {0}, *data, *p;
+	uint32_t count;
+	int64_t mtime;
+	struct stat sb;
+
+	header_len = snprintf(header, sizeof(header), "xdg-xmenu icon dirs 1 %s %d %d %s\n",
+			option.icon_theme, option.icon_size, option.scale, DATA_DIRS);
+	COUNT(open);
+	if ((fd = open(THEME_CACHE_FILE, O_RDONLY | O_CLOEXEC)) < 0)
+		return 0;
+	COUNT(stat);
+	if (fstat(fd, &sb) != 0 || (data = malloc(sb.st_size)) == NULL) {
+		close(fd);
+		return 0;
+	}
+	if (read(fd, data, sb.st_size) != sb.st_size || sb.st_size < header_len
+		|| memcmp(data, header, header_len) != 0)
+		goto done;
+
+	p = data + header_len;
+	if (!unpack(&p, data + sb.st_size, &count, sizeof(count)))
+		goto done;
+	while (count-- > 0) {
+		if (!unpack_str(&p, data + sb.st_size, path, MLEN)
+			|| !unpack(&p, data + sb.st_size, &mtime, sizeof(mtime))
+			|| file_mtime(path) != mtime)
+			goto done;
+		list_insert(&theme_files, path, MLEN);
+	}
+	if (!unpack(&p, data + sb.st_size, &count, sizeof(count)))
+		goto done;
+	while (count-- > 0) {
+		if (!unpack_str(&p, data + sb.st_size, path, MLEN))
+			goto done;
+		list_insert(&icon_dirs, path, MLEN);
+	}
+	list_reverse(&theme_files);
+	list_reverse(&icon_dirs);
+	ok = 1;
+
+done:
+	if (!ok) {
+		list_free(&theme_files);
+		list_free(&icon_dirs);
+	}
+	debug_msg("Icon theme cache %s: %s\n", ok ? "hit" : "miss", THEME_CACHE_FILE);
+	free(data);
+	close(fd);
+	return ok;
+}
+
+/* Rank of the locale of a localized key, 0 is the best match, -1 is none */
+int locale_rank(const char *locale, size_t len)
+{
+	for (int i = 0; i < locale_count; i++)
+		if (strncmp(locale_keys[i], locale, len) == 0 && locale_keys[i][len] == '\0')
+			return i;
+	return -1;
+}
+
+/* Like free_all_apps, the nodes are released by arena_reset */
+void list_free(List *list)
+{
+	list->next = NULL;
+}
+
+List *list_find_fd(List *list, int fd)
+{
+	for (List *p = list->next; p; p = p->next)
+		if (p->fd == fd)
+			return p;
+	return NULL;
+}
+
+void list_insert(List *list, char *text, int n)
+{
+	List *tmp;
+
+	tmp = arena_alloc(arena, sizeof(List), XDGMENU_MEM_LISTS);
+	snprintf(tmp->text, n, "%s", text);
+	tmp->next = list->next;
+	list->next = tmp;
+}
+
+void list_reverse(List *list)
+{
+	List *curr = list->next, *next;
+
+	list->next = NULL;
+	while (curr) {
+		next = curr->next;
+		curr->next = list->next;
+		list->next = curr;
+		curr = next;
+	}
+}
+
+/* Create the cache folder, and $XDG_CACHE_HOME too on a fresh system */
+int make_cache_dir()
+{
+	return (mkdir(XDG_CACHE_HOME, 0700) == 0 || errno == EEXIST)
+		&& (mkdir(CACHE_DIR, 0700) == 0 || errno == EEXIST);
+}
+
+/*
+ * Account for bytes allocated by a subsystem, or freed if negative, and
+ * raise the peaks. The parsing threads only sum theirs up, for parse_worker.
+ */
+void mem_add(int kind, ssize_t bytes)
+{
+	size_t used, total, peak;
+
+	if (arena != &run_arena && arena != &daemon_arena) {
+		memory_pending[kind] += bytes;
+		return;
+	}
+	used = __atomic_add_fetch(&memory.used[kind], bytes, __ATOMIC_RELAXED);
+	total = __atomic_add_fetch(&memory.used_total, bytes, __ATOMIC_RELAXED);
+	peak = __atomic_load_n(&memory.peak[kind], __ATOMIC_RELAXED);
+	while (used > peak && !__atomic_compare_exchange_n(&memory.peak[kind], &peak, used,
+			1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	peak = __atomic_load_n(&memory.peak_total, __ATOMIC_RELAXED);
+	while (total > peak && !__atomic_compare_exchange_n(&memory.peak_total, &peak, total,
+			1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+int menu_category(const char *name)
+{
+	struct Name2Icon *match = bsearch(name, category_icons, LEN(category_icons),
+			sizeof(category_icons[0]), cmp_category);
+
+	return match ? match - category_icons : NO_CATEGORY;
+}
+
+/* The options and the environment the menu looks different with, in one line */
+void menu_options(char *options, size_t size)
+{
+	snprintf(options, size, "%d %d %s %s %s %d %d %d %d %d %s %s", option.icon_size,
+			option.scale, option.icon_theme, option.terminal, option.fallback_icon,
+			option.no_genname, option.no_icon, option.frecency, option.rasterize,
+			option.actions, XDG_CURRENT_DESKTOP, LOCALE);
+}
+
+/*
+ * Cut the launch records of the commands off the menu into table, and
+ * index them by command. They follow the menu after a NUL, in the menu
+ * cache and from the daemon too, see xmenu_launch_table. A command keeps
+ * its first record. The search index after the records is moved right
+ * after the NUL of the menu, its length is returned, or 0.
+ */
+size_t menu_split(char *menu, size_t *len, Buffer *table, HashTable *commands)
+{
+	char *end, *start, *record, *command, *last, *menu_end = menu + *len;
+	size_t search_len = 0;
+	uint32_t rlen;
+	HashEntry *entry;
+
+	table->len = 0;
+	if ((end = memchr(menu, '\0', *len)) == NULL)
+		return 0;
+	*len = end - menu;
+	start = end + 1;
+
+	for (record = start; menu_end - record >= sizeof(rlen); record += sizeof(rlen) + rlen) {
+		memcpy(&rlen, record, sizeof(rlen));
+		command = record + sizeof(rlen);
+		/* a zero length ends the records */
+		if (rlen == 0) {
+			search_len = menu_end - command;
+			break;
+		}
+		if (rlen > menu_end - command)
+			break;
+		/* the command and the directory at least, all terminated */
+		last = command + rlen - 1;
+		if (*last != '\0' || memchr(command, '\0', rlen) == last)
+			break;
+		entry = hash_insert(commands, command, strlen(command));
+		if (!entry->value)
+			entry->value = record;
+	}
+
+	/* the records point into table from now on */
+	buffer_append(table, start, record - start);
+	for (size_t i = 0; i < commands->size; i++)
+		if (commands->entries[i].key)
+			commands->entries[i].value = table->data + ((char *)commands->entries[i].value - start);
+	if (search_len > 0)
+		memmove(start, menu_end - search_len, search_len);
+	return search_len;
+}
+
+/* Parse a desktop entry file, return NULL if it should not be shown */
+App *parse_app(const char *path)
+{
+	int res;
+	int64_t start = option.timing ? clock_ns(CLOCK_MONOTONIC) : 0;
+	size_t pool_len = pool->len;
+	App *app, tmp = {.category = NO_CATEGORY};
+
+	/* parse into a temporary, only the shown apps take memory */
+	debug_msg("Parse app entry: %s\n", path);
+	if ((res = parse_desktop_file(path, &tmp)) != 0)
+		debug_msg("%s parse failed: %d\n", path, res);
+	COUNT(parsed);
+
+	if (tmp.not_show || !check_app(&tmp)) {
+		mem_add(XDGMENU_MEM_STRINGS, -(ssize_t)(pool->len - pool_len));
+		pool->len = pool_len;
+		COUNT(rejected);
+		if (option.timing)
+			__atomic_add_fetch(&stats.parse_ns, clock_ns(CLOCK_MONOTONIC) - start, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	app = memcpy(arena_alloc(arena, sizeof(App), XDGMENU_MEM_APPS), &tmp, sizeof(App));
+	app->entry_path = pool_add(pool, path, strlen(path));
+	if (app->category == NO_CATEGORY)
+		app->category = MENU_OTHERS;
+	if (option.timing)
+		__atomic_add_fetch(&stats.parse_ns, clock_ns(CLOCK_MONOTONIC) - start, __ATOMIC_RELAXED);
+	/* the daemon generates the entries of a category when it is rendered,
+	 * -V for every icon size and -R once the icons are converted */
+	if (!option.daemon && !option.variants && !option.rasterize)
+		gen_entry(app);
+	return app;
+}
+
+/* Save a key of the [Desktop Entry] group, dispatched on its length and first byte */
+void parse_app_key(App *app, const char *key, size_t len, const char *value, size_t value_len)
+{
+	int category, is_true = strcmp(value, "true") == 0;
+
+#define KEY(K) (len == sizeof(K) - 1 && memcmp(key, K, len) == 0)
+	switch (len << 8 | (unsigned char)key[0]) {
+	case 4 << 8 | 'E':
+		if (KEY("Exec"))
+			app->exec = pool_add(pool, value, value_len);
+		break;
+	case 4 << 8 | 'I':
+		if (KEY("Icon"))
+			app->icon = pool_add(pool, value, value_len);
+		break;
+	case 4 << 8 | 'N':
+		if (KEY("Name"))
+			app->name = pool_add(pool, value, value_len);
+		break;
+	case 4 << 8 | 'P':
+		if (KEY("Path"))
+			app->path = pool_add(pool, value, value_len);
+		break;
+	case 4 << 8 | 'T':
+		if (KEY("Type")) {
+			app->application = strcmp(value, "Application") == 0;
+			app->not_show |= !app->application;
+		}
+		break;
+	case 6 << 8 | 'H':
+		if (KEY("Hidden"))
+			app->not_show |= is_true;
+		break;
+	case 7 << 8 | 'T':
+		if (KEY("TryExec"))
+			app->not_show |= !check_exec(value);
+		break;
+	case 8 << 8 | 'K':
+		if (KEY("Keywords"))
+			app->keywords = pool_add(pool, value, value_len);
+		break;
+	case 8 << 8 | 'T':
+		if (KEY("Terminal"))
+			app->terminal = is_true;
+		break;
+	case 9 << 8 | 'N':
+		if (KEY("NoDisplay"))
+			app->not_show |= is_true;
+		else if (KEY("NotShowIn"))
+			app->not_show |= check_desktop(value);
+		break;
+	case 10 << 8 | 'C':
+		if (KEY("Categories") && (category = extract_main_category(value)) != NO_CATEGORY)
+			app->category = category;
+		break;
+	case 10 << 8 | 'O':
+		if (KEY("OnlyShowIn"))
+			app->not_show |= !check_desktop(value);
+		break;
+	case 11 << 8 | 'G':
+		if (KEY("GenericName"))
+			app->genericname = pool_add(pool, value, value_len);
+		break;
+	}
+#undef KEY
+}
+
+/*
+ * Parse the [Desktop Entry] group of a desktop file, instead of ini_parse.
+ * The file is read in one go, and the scan stops at the next group, so the
+ * actions and most localized keys are never looked at, and scan_line skips
+ * the localized keys of other languages before that. With -a and an
+ * Actions key, the scan goes on over the [Desktop Action] groups that
+ * follow. Values are terminated in place and only copied into the string
+ * pool.
+ */
+int parse_desktop_file(const char *path, App *app)
+{
+	int fd, in_group = 0, rank, *best, name_rank = INT_MAX, genname_rank = INT_MAX;
+	int keywords_rank = INT_MAX, nactions = 0;
+	char *data, *line, *eol, *end, *eq, *key_end, *base_end, *value, *value_end, *id_end;
+	const char *actions = NULL;
+	ssize_t n;
+	struct stat sb;
+	Action action_list[MAX_ACTIONS], *action = NULL;
+
+	COUNT(open);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+	COUNT(stat);
+	if (fstat(fd, &sb) != 0 || (data = malloc(sb.st_size + SCAN_PAD)) == NULL) {
+		close(fd);
+		return -1;
+	}
+	n = pread(fd, data, sb.st_size, 0);
+	close(fd);
+	if (n < 0) {
+		free(data);
+		return -1;
+	}
+	end = data + n;
+	memset(end, 0, SCAN_PAD);
+
+	pthread_once(&scan_once, scan_select);
+	for (line = data; line < end; line = eol + 1) {
+		eol = scan_line(&line, end, &eq);
+		while (line < eol && isspace((unsigned char)*line))
+			line++;
+		if (line == eol || *line == '#')
+			continue;
+		if (*line == '[') {
+			if (in_group && !actions)  /* the next group, we are done */
+				break;
+			if (!in_group) {
+				in_group = eol - line >= 15 && memcmp(line, "[Desktop Entry]", 15) == 0;
+				continue;
+			}
+			/* past the entry, an action group or another one to skip */
+			in_group = 2;
+			action = NULL;
+			if (eol - line > 17 && memcmp(line, "[Desktop Action ", 16) == 0
+				&& (id_end = memchr(line + 16, ']', eol - line - 16)) != NULL
+				&& nactions < MAX_ACTIONS) {
+				action = &action_list[nactions++];
+				*action = (Action){.id = line + 16, .id_len = id_end - line - 16,
+					.name_rank = INT_MAX};
+			}
+			continue;
+		}
+		if (!in_group || eq == NULL || (in_group == 2 && !action))
+			continue;
+
+		for (key_end = eq; key_end > line && isspace((unsigned char)key_end[-1]); key_end--)
+			;
+		if (key_end == line)
+			continue;
+		/* localized keys, e.g. Name[de], rank below the unlocalized one */
+		rank = locale_count;
+		base_end = key_end;
+		if (key_end[-1] == ']' && ((base_end = memchr(line, '[', key_end - line)) == NULL
+				|| (rank = locale_rank(base_end + 1, key_end - base_end - 2)) < 0))
+			continue;
+#define BASE_KEY(K) (base_end - line == sizeof(K) - 1 && memcmp(line, K, sizeof(K) - 1) == 0)
+		/* only the names and keywords are localized, keep the best match of each */
+		best = action ? (BASE_KEY("Name") ? &action->name_rank : NULL)
+			: BASE_KEY("Name") ? &name_rank
+			: BASE_KEY("GenericName") ? &genname_rank
+			: BASE_KEY("Keywords") ? &keywords_rank
+			: NULL;
+		if (best ? rank > *best : rank < locale_count)
+			continue;
+		if (best)
+			*best = rank;
+		for (value = eq + 1; value < eol && isspace((unsigned char)*value); value++)
+			;
+		for (value_end = eol; value_end > value && isspace((unsigned char)value_end[-1]); value_end--)
+			;
+		*value_end = '\0';
+		if (!action)
+			parse_app_key(app, line, base_end - line, value, value_end - value);
+		else if (BASE_KEY("Name"))
+			action->name = value;
+		else if (BASE_KEY("Exec"))
+			action->exec = value;
+		else if (BASE_KEY("Icon"))
+			action->icon = value;
+		if (option.actions && !action && BASE_KEY("Actions"))
+			actions = value;
+#undef BASE_KEY
+	}
+	if (nactions > 0 && !app->not_show)
+		pack_actions(app, actions, action_list, nactions);
+	free(data);
+	return 0;
+}
+
+/* Thread function, parse batches of desktop entries until none is left */
+void *parse_worker(void *arg)
+{
+	size_t start, *batches = NULL, count = 0;
+	Str base;
+	ParseJob *job = arg;
+	Arena *saved_arena = arena, local_arena = {0};
+	Buffer *saved_pool = pool, local_pool = {0};
+
+	/* allocate from a thread local arena and pool, and hand them over at the end */
+	arena = &local_arena;
+	pool = &local_pool;
+	while ((start = __atomic_fetch_add(&job->next, BATCH, __ATOMIC_RELAXED)) < job->count) {
+		batches = realloc(batches, (count + 1) * sizeof(size_t));
+		batches[count++] = start;
+		for (size_t i = start; i < start + BATCH && i < job->count; i++)
+			job->apps[i] = parse_app(job->paths[i]);
+	}
+	arena = saved_arena;
+	pool = saved_pool;
+	for (int i = 0; i < XDGMENU_MEM_KINDS; i++) {
+		mem_add(i, memory_pending[i]);
+		memory_pending[i] = 0;
+	}
+
+	pthread_mutex_lock(&job->lock);
+	arena_merge(job->arena, &local_arena);
+	base = job->pool->len;
+	if (local_pool.len > 0)
+		buffer_append(job->pool, local_pool.data, local_pool.len);
+	pthread_mutex_unlock(&job->lock);
+
+	/* the strings of our apps moved by base */
+	for (size_t b = 0; b < count; b++)
+		for (size_t i = batches[b]; i < batches[b] + BATCH && i < job->count; i++)
+			if (job->apps[i])
+				app_rebase(job->apps[i], base);
+	free(batches);
+	free(local_pool.data);
+	return NULL;
+}
+
+/*
+ * Add the actions of an app to the pool, in the order of the Actions key.
+ * The name, Exec and Icon of each action are NUL terminated, an empty name
+ * ends them. Actions without a name or a command are left out.
+ */
+void pack_actions(App *app, const char *actions, const Action *action_list, int count)
+{
+	size_t len;
+	Buffer packed = {0};
+
+	for (const char *id = actions; *id; id += len + (id[len] == ';')) {
+		len = strcspn(id, ";");
+		for (int i = 0; i < count && app->nactions < MAX_ACTIONS; i++) {
+			if (action_list[i].id_len != len || memcmp(action_list[i].id, id, len) != 0)
+				continue;
+			if (action_list[i].name && *action_list[i].name && action_list[i].exec && *action_list[i].exec) {
+				buffer_append(&packed, action_list[i].name, strlen(action_list[i].name) + 1);
+				buffer_append(&packed, action_list[i].exec, strlen(action_list[i].exec) + 1);
+				buffer_append(&packed, action_list[i].icon ? action_list[i].icon : "",
+						strlen(action_list[i].icon ? action_list[i].icon : "") + 1);
+				app->nactions++;
+			}
+			break;
+		}
+	}
+	if (packed.len > 0)
+		app->actions = pool_add(pool, packed.data, packed.len);
+	free(packed.data);
+}
+
+void pack_str(Buffer *buffer, const char *s)
+{
+	uint16_t len = strlen(s);
+
+	buffer_append(buffer, (char *)&len, sizeof(len));
+	buffer_append(buffer, s, len);
+}
+
+/* Add a string to the pool and return its offset */
+Str pool_add(Buffer *pool, const char *s, size_t len)
+{
+	Str offset;
+	size_t start = pool->len;
+
+	/* reserve offset 0 for the empty string */
+	if (pool->len == 0)
+		buffer_append(pool, "", 1);
+	offset = pool->len;
+	buffer_append(pool, s, len);
+	pool->len++;  /* keep the terminating NUL */
+	mem_add(XDGMENU_MEM_STRINGS, pool->len - start);
+	return offset;
+}
+
+/* Empty the pool, its buffer is kept for the next strings */
+void pool_reset(Buffer *pool)
+{
+	mem_add(XDGMENU_MEM_STRINGS, -(ssize_t)pool->len);
+	pool->len = 0;
+}
+
+void prepare_envvars()
+{
+	getenv_fb(PATH, "PATH", NULL, LLEN);
+	getenv_fb(HOME, "HOME", NULL, SLEN);
+	getenv_fb(XDG_DATA_HOME, "XDG_DATA_HOME", ".local/share", SLEN);
+	getenv_fb(XDG_DATA_DIRS, "XDG_DATA_DIRS", "/usr/share:/usr/local/share", LLEN);
+	getenv_fb(XDG_CONFIG_HOME, "XDG_CONFIG_HOME", ".config", SLEN);
+	getenv_fb(XDG_CACHE_HOME, "XDG_CACHE_HOME", ".cache", SLEN);
+	getenv_fb(XDG_CURRENT_DESKTOP, "XDG_CURRENT_DESKTOP", NULL, SLEN);
+	getenv_fb(XDG_RUNTIME_DIR, "XDG_RUNTIME_DIR", NULL, SLEN);
+	snprintf(DATA_DIRS, LLEN + MLEN, "%s:%s", XDG_DATA_HOME, XDG_DATA_DIRS);
+	snprintf(CACHE_DIR, sizeof(CACHE_DIR), "%s/xdg-xmenu", XDG_CACHE_HOME);
+	snprintf(CACHE_FILE, MLEN, "%s/menu-%d@%d", CACHE_DIR, option.icon_size, option.scale);
+	if (strlen(XDG_RUNTIME_DIR) > 0)
+		snprintf(SOCKET_PATH, MLEN, "%s/xdg-xmenu.sock", XDG_RUNTIME_DIR);
+	else
+		snprintf(SOCKET_PATH, MLEN, "%s/socket", CACHE_DIR);
+	snprintf(USAGE_FILE, MLEN, "%s/usage", CACHE_DIR);
+	snprintf(RASTER_DIR, MLEN, "%s/icons", CACHE_DIR);
+	prepare_locale();
+
+	/* NOTE: the string in the second argument will be modified, do not use again */
+	split_to_list(&path_list, PATH, ":");
+	split_to_list(&data_dirs_list, DATA_DIRS, ":");
+	list_reverse(&data_dirs_list);
+	split_to_list(&current_desktop_list, XDG_CURRENT_DESKTOP, ":");
+}
+
+/* Split LOCALE into the locale_keys of localized keys, once per run */
+void prepare_locale()
+{
+	char lang[SLEN], *country, *modifier;
+
+	LOCALE[0] = '\0';
+	getenv_fb(LOCALE, "LANG", NULL, SLEN);
+	getenv_fb(LOCALE, "LC_MESSAGES", NULL, SLEN);
+	getenv_fb(LOCALE, "LC_ALL", NULL, SLEN);
+	locale_count = 0;
+	if (!LOCALE[0] || strcmp(LOCALE, "C") == 0 || strcmp(LOCALE, "POSIX") == 0)
+		return;
+
+	snprintf(lang, SLEN, "%s", LOCALE);
+	if ((modifier = strchr(lang, '@')) != NULL)
+		*modifier++ = '\0';
+	lang[strcspn(lang, ".")] = '\0';
+	if ((country = strchr(lang, '_')) != NULL)
+		*country++ = '\0';
+	/* the keys are never longer than LOCALE, but a truncated key must not
+	 * be kept, it could match the key of another locale */
+	if (country && modifier && snprintf(locale_keys[locale_count], SLEN, "%s_%s@%s",
+				lang, country, modifier) < SLEN)
+		locale_count++;
+	if (country && snprintf(locale_keys[locale_count], SLEN, "%s_%s", lang, country) < SLEN)
+		locale_count++;
+	if (modifier && snprintf(locale_keys[locale_count], SLEN, "%s@%s", lang, modifier) < SLEN)
+		locale_count++;
+	snprintf(locale_keys[locale_count++], SLEN, "%s", lang);
+}
+
+/* Remember the icon path of icon_name for rasterize_icons, if it is an svg seen the first time */
+void raster_add(Buffer *svgs, const char *icon_name)
+{
+	char icon_path[MLEN] = {0};
+	size_t len;
+
+	find_icon(icon_path, (char *)icon_name);
+	len = strlen(icon_path);
+	if (!check_file_ext(icon_path, ".svg") || hash_find(&raster_index, icon_path, len))
+		return;
+	hash_insert(&raster_index, icon_path, len);
+	buffer_append(svgs, icon_path, len + 1);
+}
+
+/* Wait for a conversion, and move its png in place with the mtime of the svg */
+void raster_finish(RasterJob *job)
+{
+	int status;
+	struct timespec times[2] = {job->mtime, job->mtime};
+	HashEntry *entry;
+
+	if (waitpid(job->pid, &status, 0) == job->pid && WIFEXITED(status)
+		&& WEXITSTATUS(status) == 0 && utimensat(AT_FDCWD, job->tmp, times, 0) == 0
+		&& rename(job->tmp, job->png) == 0) {
+		debug_msg("Rasterized %s\n", job->svg);
+		if ((entry = hash_find(&raster_index, job->svg, strlen(job->svg))) != NULL)
+			entry->data = pool_add(pool, job->png, strlen(job->png));
+	} else {
+		fprintf(stderr, "Cannot rasterize %s\n", job->svg);
+		unlink(job->tmp);
+	}
+	job->pid = 0;
+}
+
+/* Replace an svg icon path by its png, if rasterize_icons made one */
+void raster_icon(char *icon_path)
+{
+	HashEntry *entry = hash_find(&raster_index, icon_path, strlen(icon_path));
+
+	if (entry && entry->data)
+		snprintf(icon_path, MLEN, "%s", STR(entry->data));
+}
+
+/*
+ * Convert the svg icons of the menu to png once for -R, at the icon size
+ * times the scale, into RASTER_DIR. A png is named after its svg and the
+ * hash of its path, and made again when its mtime is not the svg's. Up to
+ * option.jobs conversions run at a time, the oldest one is waited for first.
+ */
+void rasterize_icons()
+{
+	int jobs, started = 0, size = option.icon_size * option.scale;
+	char size_arg[16], png[MLEN], *svg, *name;
+	const char *action;
+	char *argv[] = {RASTERIZER, "-a", "-w", size_arg, "-h", size_arg, "-o", NULL, NULL, NULL};
+	const char *dot;
+	Buffer svgs = {0};
+	RasterJob *job_list, *job;
+	struct stat src, dest;
+
+	for (App *app = all_apps.next; app; app = app->next) {
+		raster_add(&svgs, STR(app->icon));
+		/* the name, Exec and Icon of each action */
+		for (action = STR(app->actions); *action; action += strlen(action) + 1) {
+			action += strlen(action) + 1;
+			action += strlen(action) + 1;
+			if (*action)
+				raster_add(&svgs, action);
+		}
+	}
+	for (int i = 0; i < LEN(category_icons); i++)
+		raster_add(&svgs, category_icons[i].icon);
+	if (option.frecency)
+		raster_add(&svgs, "document-open-recent");
+	if (svgs.len == 0 || !make_cache_dir() || (mkdir(RASTER_DIR, 0700) != 0 && errno != EEXIST)) {
+		free(svgs.data);
+		return;
+	}
+
+	snprintf(size_arg, sizeof(size_arg), "%d", size);
+	jobs = option.jobs > 0 ? option.jobs : sysconf(_SC_NPROCESSORS_ONLN);
+	job_list = calloc(jobs, sizeof(RasterJob));
+	for (svg = svgs.data; svg < svgs.data + svgs.len; svg += strlen(svg) + 1) {
+		COUNT(stat);
+		if (stat(svg, &src) != 0)
+			continue;
+		name = strrchr(svg, '/') + 1;
+		dot = strrchr(name, '.');
+		/* the menu keeps the svg if its png path does not fit */
+		if (snprintf(png, MLEN, "%s/%.*s-%08x-%d.png", RASTER_DIR, (int)(dot - name),
+				name, hash_str(svg, strlen(svg)), size) >= MLEN)
+			continue;
+		COUNT(stat);
+		if (stat(png, &dest) == 0 && dest.st_mtim.tv_sec == src.st_mtim.tv_sec
+			&& dest.st_mtim.tv_nsec == src.st_mtim.tv_nsec) {
+			hash_find(&raster_index, svg, strlen(svg))->data = pool_add(pool, png, strlen(png));
+			continue;
+		}
+
+		job = &job_list[started % jobs];
+		if (job->pid > 0)
+			raster_finish(job);
+		snprintf(job->png, MLEN, "%s", png);
+		snprintf(job->tmp, sizeof(job->tmp), "%s.%d", png, getpid());
+		job->svg = svg;
+		job->mtime = src.st_mtim;
+		argv[7] = job->tmp;
+		argv[8] = svg;
+		if ((errno = posix_spawnp(&job->pid, RASTERIZER, NULL, NULL, argv, environ)) != 0) {
+			fprintf(stderr, "Cannot run %s: %s\n", RASTERIZER, strerror(errno));
+			job->pid = 0;
+			break;
+		}
+		started++;
+	}
+	for (int i = 0; i < jobs; i++) {
+		job = &job_list[(started + i) % jobs];
+		if (job->pid > 0)
+			raster_finish(job);
+	}
+	debug_msg("Rasterized %d svg icons\n", started);
+	free(job_list);
+	free(svgs.data);
+}
+
+/* Write the menu of the apps in app_buckets, the categories are in alphabetical order */
+void xmenu_dump(FILE *fp)
+{
+	char icon_path[MLEN] = {0};
+	size_t bases[LEN(category_icons)] = {0};
+	Buffer buffer = {0};
+
+	for (int i = 0; i < LEN(app_buckets); i++)
+		sort_apps(app_buckets[i].apps, app_buckets[i].count);
+	timing_stage("sort");
+	/* only a header, frecency_sort adds the apps, or drops it when empty */
+	if (option.frecency) {
+		if (!option.no_icon)
+			find_icon(icon_path, "document-open-recent");
+		if (option.rasterize)
+			raster_icon(icon_path);
+		if (option.no_icon || strlen(icon_path) == 0)
+			buffer_append(&buffer, "Recent\n", 7);
+		else {
+			buffer_append(&buffer, "IMG:", 4);
+			buffer_append(&buffer, icon_path, strlen(icon_path));
+			buffer_append(&buffer, "\tRecent\n", 8);
+		}
+	}
+	for (int i = 0; i < LEN(app_buckets); i++)
+		if (app_buckets[i].count > 0)
+			xmenu_dump_category(&buffer, app_buckets[i].apps, app_buckets[i].count);
+	xmenu_launch_table(&buffer);
+	timing_stage("render");
+	search_index(&buffer, bases);
+	timing_stage("search_index");
+	if (buffer.len > 0)
+		fwrite(buffer.data, 1, buffer.len, fp);
+	free(buffer.data);
+}
+
+/* Render sorted apps of one category, generating their entries if not done yet */
+void xmenu_dump_category(Buffer *buffer, App **apps, size_t count)
+{
+	char header[MLEN + SLEN] = {0};
+
+	if (count == 0)
+		return;
+	xmenu_header(header, sizeof(header), apps[0]->category);
+	buffer_append(buffer, header, strlen(header));
+	for (size_t i = 0; i < count; i++) {
+		if (!apps[i]->xmenu_entry)
+			gen_entry(apps[i]);
+		apps[i]->line = buffer->len;
+		buffer_append(buffer, STR(apps[i]->xmenu_entry), strlen(STR(apps[i]->xmenu_entry)));
+		buffer_append(buffer, "\n", 1);
+	}
+}
+
+/* Append the launch records of the apps in the menu after a NUL, see gen_entry and menu_split */
+void xmenu_launch_table(Buffer *buffer)
+{
+	int first = 1;
+	uint32_t len;
+	const char *record;
+
+	for (App *app = all_apps.next; app; app = app->next) {
+		if (!app->xmenu_entry)
+			continue;
+		if (first)
+			buffer_append(buffer, "", 1);
+		first = 0;
+		record = STR(app->launch_record);
+		for (int i = 0; i <= app->nactions; i++, record += sizeof(len) + len) {
+			memcpy(&len, record, sizeof(len));
+			buffer_append(buffer, record, sizeof(len) + len);
+		}
+	}
+}
+
+/* The line of a category at the top level of the menu, its icon is looked up once per index_icons */
+void xmenu_header(char *header, size_t size, int category)
+{
+	char *icon_path = category_icon_paths[category];
+
+	if (!option.no_icon && !(category_icons_found & 1u << category)) {
+		find_icon(icon_path, category_icons[category].icon);
+		if (option.rasterize)
+			raster_icon(icon_path);
+		category_icons_found |= 1u << category;
+	}
+	if (option.no_icon || strlen(icon_path) == 0)
+		snprintf(header, size, "%s\n", category_icons[category].category);
+	else
+		snprintf(header, size, "IMG:%s\t%s\n", icon_path, category_icons[category].category);
+}
+
+/*
+ * Write the menu to xmenu and read its output at the same time, so that
+ * neither side blocks on a full pipe whatever the menu size. The pipe to
+ * xmenu is first grown to option.pipe_size, or to the menu size up to
+ * the system limit, so a large menu takes a few writes. Returns the chosen
+ * command, to be freed, or NULL.
+ */
+char *xmenu_run(int pid, int fd_input, int fd_output, const char *menu, size_t len)
+{
+	int size = option.pipe_size;
+	char chunk[4096], *line;
+	ssize_t n;
+	FILE *fp;
+	Buffer output = {0};
+	struct pollfd fds[2] = {{fd_input, POLLOUT, 0}, {fd_output, POLLIN, 0}};
+
+	if (pid < 0)
+		return NULL;
+	if (size == 0 && (fp = fopen("/proc/sys/fs/pipe-max-size", "r")) != NULL) {
+		if (fscanf(fp, "%d", &size) != 1 || size > len)
+			size = len;
+		fclose(fp);
+	}
+	if (size > fcntl(fd_input, F_GETPIPE_SZ) && fcntl(fd_input, F_SETPIPE_SZ, size) < 0)
+		debug_msg("Cannot set the pipe size to %d: %s\n", size, strerror(errno));
+	fcntl(fd_input, F_SETFL, O_NONBLOCK);
+
+	/* until xmenu closes its output, it may exit without reading the menu */
+	while (fds[1].fd >= 0) {
+		if (poll(fds, LEN(fds), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[0].revents) {
+			/* POLLERR means xmenu closed its input */
+			errno = EPIPE;
+			n = fds[0].revents & POLLOUT ? write(fd_input, menu, len) : -1;
+			if (n > 0) {
+				menu += n;
+				len -= n;
+			}
+			if (len == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+				if (len > 0)
+					debug_msg("%s did not read %zu bytes of the menu\n", option.xmenu_cmd, len);
+				close(fd_input);
+				fds[0].fd = -1;
+			}
+		}
+		if (fds[1].revents) {
+			if ((n = read(fd_output, chunk, sizeof(chunk))) > 0) {
+				buffer_append(&output, chunk, n);
+			} else if (n == 0 || errno != EINTR) {
+				close(fd_output);
+				fds[1].fd = -1;
+			}
+		}
+	}
+	if (fds[0].fd >= 0)
+		close(fd_input);
+	if (fds[1].fd >= 0)
+		close(fd_output);
+	waitpid(pid, NULL, 0);
+
+	/* the first line is the chosen entry */
+	buffer_append(&output, "", 1);
+	if ((line = strtok(output.data, "\n")) != NULL)
+		line = strdup(line);
+	free(output.data);
+	return line;
+}
+
+/*
+ * Start xmenu before the menu is generated, so that it connects to the X
+ * server and loads its fonts in the meantime. It waits for the menu on
+ * its stdin, see xmenu_run.
+ */
+int xmenu_start(int argc, char *argv[], int *fd_input, int *fd_output)
+{
+	int pid;
+	char **xmenu_argv;
+
+	/* construct xmenu args for exec(3).
+	 * +2 is for leading 'xmenu' and the ending NULL
+	 * if no_icon is set, add another '-i' option */
+	xmenu_argv = calloc(argc + (option.no_icon ? 3 : 2), sizeof(char*));
+	xmenu_argv[0] = option.xmenu_cmd;
+	for (int i = 0; i < argc; i++)
+		xmenu_argv[i + 1] = argv[i];
+	if (option.no_icon && strcmp(option.xmenu_cmd, "xmenu") == 0)
+		xmenu_argv[argc + 1] = "-i";
+
+	/* xmenu may exit without reading the whole menu */
+	signal(SIGPIPE, SIG_IGN);
+	pid = spawn(option.xmenu_cmd, xmenu_argv, fd_input, fd_output);
+	free(xmenu_argv);
+	return pid;
+}
+
+/*
+ * Generate the menus of all SIZE[@SCALE] in option.variants with a single
+ * scan of the desktop entries, only the icons are looked up for each one.
+ * The menus are saved as the menu caches of these sizes and scales, and
+ * their paths printed.
+ */
+void xmenu_variants()
+{
+	int size, scale;
+	char *list = strdup(option.variants), *variant, *saveptr, *menu, *fingerprint;
+	size_t mlen, flen;
+	FILE *fp;
+
+	find_all_apps();
+	timing_stage("find_all_apps");
+	for (variant = strtok_r(list, ",", &saveptr); variant; variant = strtok_r(NULL, ",", &saveptr)) {
+		scale = 1;
+		if (sscanf(variant, "%d@%d", &size, &scale) < 1 || size <= 0 || scale <= 0) {
+			fprintf(stderr, "Invalid icon size: %s\n", variant);
+			continue;
+		}
+		option.icon_size = size;
+		option.scale = scale;
+		snprintf(CACHE_FILE, MLEN, "%s/menu-%d@%d", CACHE_DIR, size, scale);
+
+		close_icon_dirs();
+		if (!option.no_icon) {
+			find_icon_dirs();
+			index_icons();
+			find_icon(FALLBACK_ICON_PATH, option.fallback_icon);
+			if (option.rasterize)
+				rasterize_icons();
+		}
+		for (App *app = all_apps.next; app; app = app->next)
+			app->xmenu_entry = 0;
+		fp = open_memstream(&menu, &mlen);
+		xmenu_dump(fp);
+		fclose(fp);
+		fp = open_memstream(&fingerprint, &flen);
+		cache_fingerprint(fp);
+		fclose(fp);
+
+		if (cache_save(fingerprint, flen, menu, mlen))
+			puts(CACHE_FILE);
+		else
+			fprintf(stderr, "Cannot write %s\n", CACHE_FILE);
+		free(fingerprint);
+		free(menu);
+		timing_stage(variant);
+	}
+	free(list);
+}
+
+/* Save icon_dirs and theme_files, see load_theme_cache for the format */
+void save_theme_cache()
+{
+	int fd;
+	char header[LLEN + MLEN + SLEN] = {0}, tmp_file[MLEN + 16] = {0};
+	uint32_t count;
+	int64_t mtime;
+	Buffer buffer = {0};
+
+	if (!make_cache_dir())
+		return;
+	snprintf(header, sizeof(header), "xdg-xmenu icon dirs 1 %s %d %d %s\n",
+			option.icon_theme, option.icon_size, option.scale, DATA_DIRS);
+	buffer_append(&buffer, header, strlen(header));
+
+	count = 0;
+	for (List *file = theme_files.next; file; file = file->next)
+		count++;
+	buffer_append(&buffer, (char *)&count, sizeof(count));
+	for (List *file = theme_files.next; file; file = file->next) {
+		mtime = file_mtime(file->text);
+		pack_str(&buffer, file->text);
+		buffer_append(&buffer, (char *)&mtime, sizeof(mtime));
+	}
+	count = 0;
+	for (List *dir = icon_dirs.next; dir; dir = dir->next)
+		count++;
+	buffer_append(&buffer, (char *)&count, sizeof(count));
+	for (List *dir = icon_dirs.next; dir; dir = dir->next)
+		pack_str(&buffer, dir->text);
+
+	/* write to a temporary file and rename it, like cache_save */
+	snprintf(tmp_file, sizeof(tmp_file), "%s.%d", THEME_CACHE_FILE, getpid());
+	COUNT(open);
+	if ((fd = open(tmp_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) >= 0) {
+		if (write_all(fd, buffer.data, buffer.len) && close(fd) == 0
+			&& rename(tmp_file, THEME_CACHE_FILE) == 0)
+			debug_msg("Icon theme cache saved: %s\n", THEME_CACHE_FILE);
+		else
+			unlink(tmp_file);
+	}
+	free(buffer.data);
+}
+
+/*
+ * Find the end of the next line from *line on and its first '=' (NULL if
+ * none). Localized keys of other languages, e.g. Name[fr] for LOCALE
+ * de_DE, are skipped in bulk without reaching the parser, which would drop
+ * them anyway. *line is moved to the start of the line found. The data is
+ * read up to SCAN_PAD bytes past end, which must be zeroed.
+ */
+char *scan_line(char **line, char *end, char **eq)
+{
+	char *eol, *bracket;
+	const char *lang = locale_count ? locale_keys[locale_count - 1] : "";
+	size_t len = strlen(lang);
+
+	for (;;) {
+		eol = scan_kernel(*line, end, eq, &bracket);
+		/* not a key with a locale, e.g. a group header or Exec=a[b] */
+		if (eol == end || !bracket || bracket == *line || !*eq || (*eq)[-1] != ']')
+			return eol;
+		/* the keys of the language of LOCALE, locale_rank picks among them */
+		if (locale_count && strncmp(bracket + 1, lang, len) == 0
+			&& (bracket[len + 1] == ']' || bracket[len + 1] == '_' || bracket[len + 1] == '@'))
+			return eol;
+		*line = eol + 1;
+	}
+}
+
+/*
+ * Take the first '\n', '=' and '[' (before the '=') of a vector of a
+ * scan kernel from their masks, of 1 << shift bits per byte. Return the end
+ * of the line, or NULL if it goes on past the vector.
+ */
+char *scan_masks(char *p, char *end, int shift, uint64_t lines, uint64_t eqs,
+		uint64_t brackets, char **eq, char **bracket)
+{
+	int eol = lines ? __builtin_ctzll(lines) : 64;
+
+	if (brackets && __builtin_ctzll(brackets) < eol
+		&& (!eqs || __builtin_ctzll(brackets) < __builtin_ctzll(eqs)))
+		*bracket = p + (__builtin_ctzll(brackets) >> shift);
+	if (eqs && __builtin_ctzll(eqs) < eol)
+		*eq = p + (__builtin_ctzll(eqs) >> shift);
+	if (!lines)
+		return NULL;
+	p += eol >> shift;
+	return p < end ? p : end;
+}
+
+#if defined(__ARM_NEON)
+/* NEON has no movemask, narrow the comparison to four bits per byte */
+#define MOVEMASK(X) vget_lane_u64(vreinterpret_u64_u8( \
+		vshrn_n_u16(vreinterpretq_u16_u8(X), 4)), 0)
+
+/* The scan kernel for NEON, 16 bytes at a time, always there on aarch64 */
+char *scan_neon(char *line, char *end, char **eq, char **bracket)
+{
+	const uint8x16_t newline = vdupq_n_u8('\n'), equal = vdupq_n_u8('='), open = vdupq_n_u8('[');
+	uint8x16_t v;
+	char *eol;
+
+	*eq = *bracket = NULL;
+	for (char *p = line; p < end; p += 16) {
+		v = vld1q_u8((const uint8_t *)p);
+		if ((eol = scan_masks(p, end, 2, MOVEMASK(vceqq_u8(v, newline)),
+				*eq ? 0 : MOVEMASK(vceqq_u8(v, equal)),
+				*eq || *bracket ? 0 : MOVEMASK(vceqq_u8(v, open)), eq, bracket)) != NULL)
+			return eol;
+	}
+	return end;
 }
+#undef MOVEMASK
+#endif
 
-/* Handler for ini_parse, parse app info and save in App variable pointed by *user */
-int handler_parse_app(void *user, const char *section, const char *name, const char *value)
-{
-	App *app = (App *)user;
-	if (strcmp(section, "Desktop Entry") == 0) {
-		if (strcmp(name, "Exec") == 0)
-			snprintf(app->exec, MLEN, "%s", value);
-		else if (strcmp(name, "Type") == 0)
-			snprintf(app->type, SLEN, "%s", value);
-		else if (strcmp(name, "Icon") == 0)
-			snprintf(app->icon, SLEN, "%s", value);
-		else if (strcmp(name, "Name") == 0)
-			snprintf(app->name, SLEN, "%s", value);
-		else if (strcmp(name, "Terminal") == 0)
-			app->terminal = strcmp(value, "true") == 0;
-		else if (strcmp(name, "GenericName") == 0)
-			snprintf(app->genericname, SLEN, "%s", value);
-		else if (strcmp(name, "Categories") == 0)
-			extract_main_category(app->category, value);
-		else if (strcmp(name, "Path") == 0)
-			snprintf(app->path, MLEN, "%s", value);
-
-		if ((strcmp(name, "NoDisplay") == 0 && strcmp(value, "true") == 0)
-			|| (strcmp(name, "Hidden") == 0 && strcmp(value, "true") == 0)
-			|| (strcmp(name, "Type") == 0 && strcmp(value, "Application") != 0)
-			|| (strcmp(name, "TryExec") == 0 && check_exec(value) == 0)
-			|| (strcmp(name, "NotShowIn") == 0 && check_desktop(value))
-			|| (strcmp(name, "OnlyShowIn") == 0 && !check_desktop(value)))
-			app->not_show = 1;
-	}
-	return 1;
+/* The scan kernel for any CPU */
+char *scan_scalar(char *line, char *end, char **eq, char **bracket)
+{
+	char *eol;
+
+	if ((eol = memchr(line, '\n', end - line)) == NULL)
+		eol = end;
+	*eq = memchr(line, '=', eol - line);
+	*bracket = memchr(line, '[', (*eq ? *eq : eol) - line);
+	return eol;
 }
 
-int handler_set_icon_theme(void *user, const char *section, const char *name, const char *value)
+/*
+ * Pick the kernel of scan_line: SSE2 if the CPU has it, which every x86-64
+ * does, NEON if the build targets it, which every aarch64 one does, the
+ * scalar one otherwise. Lines are mostly shorter than 32 bytes, so wider
+ * vectors would not pay off.
+ */
+void scan_select()
 {
-	if (strcmp(section, "Settings") == 0 && strcmp(name, "gtk-icon-theme-name") == 0)
-		strcpy(FALLBACK_ICON_THEME, value);
-	return 1;
+	scan_kernel = scan_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("sse2"))
+		scan_kernel = scan_sse2;
+#elif defined(__ARM_NEON)
+	scan_kernel = scan_neon;
+#endif
 }
 
-void list_free(List *list)
+#if defined(__x86_64__) || defined(__i386__)
+/* The scan kernel for SSE2, 16 bytes at a time, built for it on i386 too */
+__attribute__ ((target("sse2")))
+char *scan_sse2(char *line, char *end, char **eq, char **bracket)
 {
-	List *p = list->next, *tmp;
+	const __m128i newline = _mm_set1_epi8('\n'), equal = _mm_set1_epi8('='), open = _mm_set1_epi8('[');
+	__m128i v;
+	char *eol;
 
-	list->next = NULL;
-	while (p) {
-		tmp = p->next;
-		free(p);
-		p = tmp;
+	*eq = *bracket = NULL;
+	for (char *p = line; p < end; p += 16) {
+		v = _mm_loadu_si128((const __m128i *)p);
+		if ((eol = scan_masks(p, end, 0, _mm_movemask_epi8(_mm_cmpeq_epi8(v, newline)),
+				*eq ? 0 : _mm_movemask_epi8(_mm_cmpeq_epi8(v, equal)),
+				*eq || *bracket ? 0 : _mm_movemask_epi8(_mm_cmpeq_epi8(v, open)),
+				eq, bracket)) != NULL)
+			return eol;
 	}
+	return end;
 }
+#endif
 
-void list_insert(List *list, char *text, int n)
+/* Append s folded to lower case, as the search texts and the queries are */
+void search_fold(Buffer *buffer, const char *s, size_t len)
 {
-	List *tmp;
-
-	tmp = calloc(1, sizeof(List));
-	snprintf(tmp->text, n, "%s", text);
-	tmp->next = list->next;
-	list->next = tmp;
+	buffer_append(buffer, s, len);
+	for (char *p = buffer->data + buffer->len - len; p < buffer->data + buffer->len; p++)
+		*p = tolower((unsigned char)*p);
 }
 
-void list_reverse(List *list)
+/*
+ * Append the search index of the apps in the menu for -q, after a zero
+ * length that ends the launch records. The line of an app is at its offset
+ * plus the base of its category in the menu. The index is, in uint32s
+ * - the counts of the apps, trigrams and postings
+ * - for each app, the offset of its search text from the start of the
+ *   texts, and of its line in the menu
+ * - the trigrams in ascending order, each with the start and count of its
+ *   postings, the ascending numbers of the apps that have it
+ * - the postings
+ * - the search texts: the name, GenericName, Exec basename and Keywords of
+ *   an app, folded and separated by tabs
+ * A trigram is 3 bytes of a search text without a separator, so any query
+ * word of 3 bytes or more only needs to look at the apps of one trigram.
+ */
+void search_index(Buffer *buffer, const size_t *bases)
 {
-	List *curr = list->next, *next;
+	int run;
+	uint32_t napps = 0, ntrigrams = 0, npostings, key, *apps, *postings;
+	size_t size = 4096, start;
+	const char *exec, *end_exec, *base, *text;
+	Buffer texts = {0}, keys = {0};
+	Trigram *slots, *slot, *old_slots, *trigrams;
 
-	list->next = NULL;
-	while (curr) {
-		next = curr->next;
-		curr->next = list->next;
-		list->next = curr;
-		curr = next;
+	for (App *app = all_apps.next; app; app = app->next)
+		napps += app->xmenu_entry != 0;
+	if (napps == 0)
+		return;
+	apps = calloc(2 * napps, sizeof(uint32_t));
+	napps = 0;
+	for (App *app = all_apps.next; app; app = app->next) {
+		if (!app->xmenu_entry)
+			continue;
+		apps[2 * napps] = texts.len;
+		apps[2 * napps + 1] = bases[app->category] + app->line;
+		napps++;
+		search_fold(&texts, STR(app->name), strlen(STR(app->name)));
+		buffer_append(&texts, "\t", 1);
+		search_fold(&texts, STR(app->genericname), strlen(STR(app->genericname)));
+		buffer_append(&texts, "\t", 1);
+		/* the basename of the first word of Exec, without quotes */
+		for (exec = STR(app->exec); *exec == '"'; exec++)
+			;
+		end_exec = exec + strcspn(exec, " \t\"");
+		for (base = end_exec; base > exec && base[-1] != '/'; base--)
+			;
+		search_fold(&texts, base, end_exec - base);
+		buffer_append(&texts, "\t", 1);
+		search_fold(&texts, STR(app->keywords), strlen(STR(app->keywords)));
+		buffer_append(&texts, "", 1);
 	}
-}
 
-void prepare_envvars()
-{
-	getenv_fb(PATH, "PATH", NULL, LLEN);
-	getenv_fb(HOME, "HOME", NULL, SLEN);
-	getenv_fb(XDG_DATA_HOME, "XDG_DATA_HOME", ".local/share", SLEN);
-	getenv_fb(XDG_DATA_DIRS, "XDG_DATA_DIRS", "/usr/share:/usr/local/share", LLEN);
-	getenv_fb(XDG_CONFIG_HOME, "XDG_CONFIG_HOME", ".config", SLEN);
-	getenv_fb(XDG_CURRENT_DESKTOP, "XDG_CURRENT_DESKTOP", NULL, SLEN);
-	snprintf(DATA_DIRS, LLEN + MLEN, "%s:%s", XDG_DATA_DIRS, XDG_DATA_HOME);
+	/* count the apps of every trigram, and list the trigrams of each app once */
+	slots = calloc(size, sizeof(Trigram));
+	for (uint32_t i = 0; i < napps; i++) {
+		key = run = 0;
+		for (text = texts.data + apps[2 * i]; *text; text++) {
+			if (search_separator(*text)) {
+				run = 0;
+				continue;
+			}
+			key = (key << 8 | (unsigned char)*text) & 0xffffff;
+			if (++run < 3)
+				continue;
+			if ((slot = search_slot(slots, size, key))->key == 0) {
+				/* keep the load factor under 1/2 */
+				if (2 * (ntrigrams + 1) > size) {
+					old_slots = slots;
+					slots = calloc(2 * size, sizeof(Trigram));
+					for (size_t j = 0; j < size; j++)
+						if (old_slots[j].key)
+							*search_slot(slots, 2 * size, old_slots[j].key) = old_slots[j];
+					free(old_slots);
+					size *= 2;
+					slot = search_slot(slots, size, key);
+				}
+				slot->key = key;
+				ntrigrams++;
+			}
+			if (slot->last != i + 1) {
+				slot->last = i + 1;
+				slot->count++;
+				buffer_append(&keys, (char *)&key, sizeof(key));
+			}
+		}
+		/* the end of the trigrams of the app */
+		buffer_append(&keys, "\0\0\0\0", sizeof(key));
+	}
 
-	/* NOTE: the string in the second argument will be modified, do not use again */
-	split_to_list(&path_list, PATH, ":");
-	split_to_list(&data_dirs_list, DATA_DIRS, ":");
-	split_to_list(&current_desktop_list, XDG_CURRENT_DESKTOP, ":");
+	trigrams = calloc(ntrigrams + 1, sizeof(Trigram));
+	ntrigrams = 0;
+	for (size_t i = 0; i < size; i++)
+		if (slots[i].key)
+			trigrams[ntrigrams++] = slots[i];
+	qsort(trigrams, ntrigrams, sizeof(Trigram), cmp_trigram);
+	start = 0;
+	for (uint32_t i = 0; i < ntrigrams; i++) {
+		search_slot(slots, size, trigrams[i].key)->start = trigrams[i].start = start;
+		start += trigrams[i].count;
+	}
+	/* the apps are numbered in ascending order, so are their postings */
+	npostings = start;
+	postings = calloc(npostings + 1, sizeof(uint32_t));
+	for (uint32_t i = 0, *k = (uint32_t *)keys.data; i < napps; k++) {
+		if (*k == 0)
+			i++;
+		else
+			postings[search_slot(slots, size, *k)->start++] = i;
+	}
+
+	buffer_append(buffer, "\0\0\0\0", sizeof(uint32_t));
+	buffer_append(buffer, (char *)&napps, sizeof(uint32_t));
+	buffer_append(buffer, (char *)&ntrigrams, sizeof(uint32_t));
+	buffer_append(buffer, (char *)&npostings, sizeof(uint32_t));
+	buffer_append(buffer, (char *)apps, 2 * napps * sizeof(uint32_t));
+	for (uint32_t i = 0; i < ntrigrams; i++) {
+		buffer_append(buffer, (char *)&trigrams[i].key, sizeof(uint32_t));
+		buffer_append(buffer, (char *)&trigrams[i].start, sizeof(uint32_t));
+		buffer_append(buffer, (char *)&trigrams[i].count, sizeof(uint32_t));
+	}
+	buffer_append(buffer, (char *)postings, npostings * sizeof(uint32_t));
+	buffer_append(buffer, texts.data, texts.len);
+	debug_msg("Search index: %u apps, %u trigrams, %u postings\n", napps, ntrigrams, npostings);
+
+	free(postings);
+	free(trigrams);
+	free(slots);
+	free(apps);
+	free(keys.data);
+	free(texts.data);
 }
 
-void xmenu_dump(FILE *fp)
+/*
+ * Append the lines of the apps in menu that match every word of query, to
+ * be shown at the top level of xmenu. The best matches come first, the
+ * score of a word is 3 at the start of the name, 2 at the start of a word
+ * of the name, 1 elsewhere in the name and 0 in the rest of the search text.
+ */
+void search_menu(const char *index, size_t len, const char *menu, size_t menu_len, const char *query, Buffer *out)
 {
-	int i, count;
-	char icon_path[MLEN] = {0}, *curcat = NULL;
-	App **app_array, *app;
+	int nwords = 0, nresults = 0, all = 1, score;
+	uint32_t napps, ntrigrams, npostings, count, candidates, first = 0, key, lo, hi, mid, app, line;
+	size_t words_len, texts_len;
+	char *words[SLEN], *p;
+	const char *texts, *text, *name_end, *match, *eol;
+	Buffer folded = {0};
+	SearchResult *results;
 
-	/* construct an array of apps from the linked list */
-	for (count = 0, app = all_apps.next; app; count++, app = app->next)
-		; /* count the apps */
-	app_array = calloc(count + 1, sizeof(App *));
-	for (i = 0, app = all_apps.next; app; i++, app = app->next)
-		app_array[i] = app;
-
-	qsort(app_array, count, sizeof(App *), cmp_app_category_name);
-	for (i = 0; i < count; i++) {
-		app = app_array[i];
-		if (!curcat || strcmp(curcat, app->category)) {
-			curcat = app->category;
-			if (!option.no_icon)
-				for (int j = 0; j < LEN(category_icons); j++)
-					if (strcmp(app->category, category_icons[j].category) == 0) {
-						find_icon(icon_path, category_icons[j].icon);
+	if (len < 3 * sizeof(uint32_t))
+		return;
+	napps = search_u32(index, 0);
+	ntrigrams = search_u32(index, 1);
+	npostings = search_u32(index, 2);
+	words_len = 3 + 2 * (size_t)napps + 3 * (size_t)ntrigrams + npostings;
+	if (words_len > len / sizeof(uint32_t) || index[len - 1] != '\0')
+		return;
+	texts = index + words_len * sizeof(uint32_t);
+	texts_len = len - words_len * sizeof(uint32_t);
+
+	/* the words of the query, the rest of a very long one is ignored */
+	search_fold(&folded, query, strlen(query) + 1);
+	for (p = folded.data; *p && nwords < LEN(words); ) {
+		while (search_separator(*p))
+			*p++ = '\0';
+		if (!*p)
+			break;
+		words[nwords++] = p;
+		while (*p && !search_separator(*p))
+			p++;
+	}
+	if (nwords == 0) {
+		free(folded.data);
+		return;
+	}
+
+	/* the apps of the rarest trigram, or all apps for short words */
+	candidates = napps;
+	for (int w = 0; w < nwords; w++) {
+		for (p = words[w]; p[0] && p[1] && p[2]; p++) {
+			key = (unsigned char)p[0] << 16 | (unsigned char)p[1] << 8 | (unsigned char)p[2];
+			for (lo = 0, hi = ntrigrams, count = 0; lo < hi; ) {
+				mid = lo + (hi - lo) / 2;
+				if (search_u32(index, 3 + 2 * napps + 3 * mid) < key)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			if (lo < ntrigrams && search_u32(index, 3 + 2 * napps + 3 * lo) == key)
+				count = search_u32(index, 3 + 2 * napps + 3 * lo + 2);
+			/* no app has this trigram, so none matches the word */
+			if (count == 0) {
+				free(folded.data);
+				return;
+			}
+			if (all || count < candidates) {
+				all = 0;
+				candidates = count;
+				first = search_u32(index, 3 + 2 * napps + 3 * lo + 1);
+			}
+		}
+	}
+	if (!all && (size_t)first + candidates > npostings) {
+		free(folded.data);
+		return;
+	}
+
+	results = calloc(candidates + 1, sizeof(SearchResult));
+	for (uint32_t i = 0; i < candidates; i++) {
+		app = all ? i : search_u32(index, 3 + 2 * napps + 3 * ntrigrams + first + i);
+		if (app >= napps || search_u32(index, 3 + 2 * app) >= texts_len
+			|| search_u32(index, 3 + 2 * app + 1) >= menu_len)
+			continue;
+		text = texts + search_u32(index, 3 + 2 * app);
+		name_end = strchr(text, '\t');
+		name_end = name_end ? name_end : text + strlen(text);
+		score = 0;
+		for (int w = 0; w < nwords && score >= 0; w++) {
+			if ((match = strstr(text, words[w])) == NULL)
+				score = -1;
+			else if (match == text)
+				score += 3;
+			else if (match < name_end) {
+				score++;
+				for (; match && match < name_end; match = strstr(match + 1, words[w]))
+					if (!isalnum((unsigned char)match[-1])) {
+						score++;
 						break;
 					}
-			if (option.no_icon || strlen(icon_path) == 0)
-				fprintf(fp, "%s\n", curcat);
-			else
-				fprintf(fp, "IMG:%s\t%s\n", icon_path, curcat);
+			}
 		}
-		fprintf(fp, "%s\n", app->xmenu_entry);
+		if (score >= 0)
+			results[nresults++] = (SearchResult){.score = score, .text = text,
+				.line = search_u32(index, 3 + 2 * app + 1)};
 	}
-	free(app_array);
+	qsort(results, nresults, sizeof(SearchResult), cmp_search_result);
+	for (int i = 0; i < nresults; i++) {
+		/* the app's line and its submenu, one level up */
+		line = results[i].line;
+		do {
+			line++;
+			eol = memchr(menu + line, '\n', menu_len - line);
+			eol = eol ? eol : menu + menu_len;
+			buffer_append(out, menu + line, eol - (menu + line));
+			buffer_append(out, "\n", 1);
+			line = eol - menu + 1;
+		} while (line + 1 < menu_len && menu[line] == '\t' && menu[line + 1] == '\t');
+	}
+	free(results);
+	free(folded.data);
 }
 
-void xmenu_run(int argc, char *argv[])
+/* Separators of the words in search texts and queries */
+int search_separator(char c)
 {
-	int pid, fd_input, fd_output;
-	char **xmenu_argv, line[LLEN] = {0};
-	FILE *fp;
+	return c == ' ' || c == '\t' || c == ';';
+}
 
-	/* construct xmenu args for exec(3).
-	 * +2 is for leading 'xmenu' and the ending NULL
-	 * if no_icon is set, add another '-i' option */
-	xmenu_argv = calloc(argc + option.no_icon ? 3 : 2, sizeof(char*));
-	xmenu_argv[0] = option.xmenu_cmd;
-	for (int i = 0; i < argc; i++)
-		xmenu_argv[i + 1] = argv[i];
-	if (option.no_icon && strcmp(option.xmenu_cmd, "xmenu") == 0)
-		xmenu_argv[argc + 1] = "-i";
+/* The slot of a trigram key in the open addressing table of search_index, or a free one */
+Trigram *search_slot(Trigram *slots, size_t size, uint32_t key)
+{
+	size_t i;
 
-	pid = spawn(option.xmenu_cmd, xmenu_argv, &fd_input, &fd_output);
-	fp = fdopen(fd_input, "w");
-	xmenu_dump(fp);
-	fclose(fp);
+	/* Fibonacci hashing, the keys are small integers */
+	for (i = (key * 2654435761u) >> 8 & (size - 1);
+		 slots[i].key && slots[i].key != key; i = (i + 1) & (size - 1))
+		;
+	return &slots[i];
+}
 
-	waitpid(pid, NULL, 0);
-	/* Note: use larger buffer size (close to 4k) to get better performance */
-	if (read(fd_output, line, LLEN) > 0) {
-		*strchr(line, '\n') = 0;
-		if (option.dry_run)
-			puts(line);
-		else
-			system(strcat(line, " &"));
+/* The i-th uint32 of a search index, which is not aligned */
+uint32_t search_u32(const char *index, size_t i)
+{
+	uint32_t value;
+
+	memcpy(&value, index + i * sizeof(uint32_t), sizeof(value));
+	return value;
+}
+
+/*
+ * Sort the apps of a category by name, ignoring case. The names are folded
+ * once into sort keys instead of in every comparison.
+ */
+void sort_apps(App **apps, size_t count)
+{
+	size_t total = 0, len;
+	char *folded, *key;
+	SortKey *keys = calloc(count + 1, sizeof(SortKey));
+
+	for (size_t i = 0; i < count; i++)
+		total += strlen(STR(apps[i]->name)) + 1;
+	key = folded = malloc(total + 1);
+	for (size_t i = 0; i < count; i++) {
+		const char *name = STR(apps[i]->name);
+
+		len = strlen(name);
+		for (size_t j = 0; j <= len; j++)
+			key[j] = tolower((unsigned char)name[j]);
+		keys[i] = (SortKey){.key = key, .app = apps[i]};
+		for (size_t j = 0; j < 8; j++)
+			keys[i].prefix = keys[i].prefix << 8 | (unsigned char)(j < len ? key[j] : 0);
+		key += len + 1;
 	}
-	close(fd_output);
+	qsort(keys, count, sizeof(SortKey), cmp_sort_key);
+	for (size_t i = 0; i < count; i++)
+		apps[i] = keys[i].app;
+	free(folded);
+	free(keys);
 }
 
 void set_icon_theme()
@@ -633,6 +3789,7 @@ void set_icon_theme()
 
 	/* Check gtk3 settings.ini file and overwrite default icon theme */
 	snprintf(gtk3_settings, MLEN, "%s/gtk-3.0/settings.ini", XDG_CONFIG_HOME);
+	COUNT(access);
 	if (access(gtk3_settings, F_OK) == 0) {
 		real_path = realpath(gtk3_settings, NULL);
 		debug_msg("Ini parse gtk settings: %s\n", real_path);
@@ -653,8 +3810,14 @@ int spawn(const char *cmd, char *const argv[], int *fd_input, int *fd_output)
 	pid_t pid;
 	int pfd_read[2], pfd_write[2];
 
-	pipe(pfd_read);
-	pipe(pfd_write);
+	/* only the ends dup'ed to stdin and stdout are inherited */
+	if (pipe2(pfd_read, O_CLOEXEC) < 0)
+		return -1;
+	if (pipe2(pfd_write, O_CLOEXEC) < 0) {
+		close(pfd_read[0]);
+		close(pfd_read[1]);
+		return -1;
+	}
 
 	if ((pid = fork()) == 0) { /* in child */
 		dup2(pfd_read[1], 1);
@@ -662,6 +3825,7 @@ int spawn(const char *cmd, char *const argv[], int *fd_input, int *fd_output)
 		close(pfd_read[0]);
 		close(pfd_write[1]);
 		execvp(cmd, argv);
+		_exit(127);
 	} else if (pid > 0) { /* in parent */
 		*fd_output = pfd_read[0];
 		*fd_input = pfd_write[1];
@@ -674,53 +3838,526 @@ int spawn(const char *cmd, char *const argv[], int *fd_input, int *fd_output)
 
 void split_to_list(List *list, const char *env_string, char *sep)
 {
-	char *buffer = strdup(env_string);
+	char *buffer = strdup(env_string), *saveptr;
 
-	for (char *p = strtok(buffer, sep); p; p = strtok(NULL, sep))
+	/* strtok_r, a context can be refreshed from any thread */
+	for (char *p = strtok_r(buffer, sep, &saveptr); p; p = strtok_r(NULL, sep, &saveptr))
 		list_insert(list, p, SLEN);
 	free(buffer);
 }
 
-int xdgmenu(int argc, char *argv[])
+/*
+ * Print the wall and CPU time since the previous stage to stderr, for -T.
+ * The CPU time is the one of the whole process, so of all threads.
+ * A NULL stage only starts the clocks and resets the counters.
+ */
+void timing_stage(const char *stage)
+{
+	static int64_t wall, cpu;
+	int64_t now_wall, now_cpu;
+
+	if (!option.timing)
+		return;
+	now_wall = clock_ns(CLOCK_MONOTONIC);
+	now_cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+	if (!stage)
+		memset(&stats, 0, sizeof(stats));
+	else if (timing_hook)
+		timing_hook(stage, now_wall - wall, now_cpu - cpu);
+	else
+		fprintf(stderr, "TIME: %-16s wall %8.3f ms  cpu %8.3f ms\n", stage,
+				(now_wall - wall) / 1e6, (now_cpu - cpu) / 1e6);
+	wall = now_wall;
+	cpu = now_cpu;
+}
+
+/* Print the thread times and counters of -T, the hook gets the thread times only */
+void timing_summary()
+{
+	if (!option.timing)
+		return;
+	if (timing_hook) {
+		timing_hook("parse (threads)", stats.parse_ns, -1);
+		timing_hook("icons (threads)", stats.icon_ns, -1);
+		return;
+	}
+	fprintf(stderr, "TIME: parse %.3f ms, icon lookup %.3f ms, summed over threads\n",
+			stats.parse_ns / 1e6, stats.icon_ns / 1e6);
+	fprintf(stderr, "COUNT: desktop files %zu parsed, %zu rejected, %zu shadowed; "
+			"syscalls %zu open, %zu stat, %zu access\n", stats.parsed, stats.rejected,
+			stats.shadowed, stats.open, stats.stat, stats.access);
+	fprintf(stderr, "MEM: peak");
+	for (int i = 0; i < XDGMENU_MEM_KINDS; i++)
+		fprintf(stderr, " %s %.1f kB,", memory_names[i], memory.peak[i] / 1024.0);
+	fprintf(stderr, " all %.1f kB; in use %.1f kB, leaked %zu bytes\n", memory.peak_total / 1024.0,
+			memory.used_total / 1024.0, memory.leaked);
+}
+
+/* Read n bytes from *p, if there are enough before end */
+int unpack(char **p, const char *end, void *dest, size_t n)
+{
+	if (end - *p < n)
+		return 0;
+	memcpy(dest, *p, n);
+	*p += n;
+	return 1;
+}
+
+/* Read a string written by pack_str into dest */
+int unpack_str(char **p, const char *end, char *dest, size_t size)
+{
+	uint16_t len;
+
+	if (!unpack(p, end, &len, sizeof(len)) || len >= size || !unpack(p, end, dest, len))
+		return 0;
+	dest[len] = '\0';
+	return 1;
+}
+
+/* Forget the scores of usage_load, the next run reads the log again */
+void usage_free()
+{
+	mem_add(XDGMENU_MEM_USAGE, -(ssize_t)(usage_count * sizeof(UsageScore)));
+	free(usage_scores);
+	usage_scores = NULL;
+	usage_count = 0;
+}
+
+/*
+ * Read the usage log and sum up a score for every command, recent launches
+ * weigh more. The log is mapped, and a missing log costs a failed open.
+ * Returns the number of records read, call with usage_lock held.
+ */
+size_t usage_load(const char *file)
+{
+	int fd;
+	size_t count;
+	time_t now = time(NULL), age;
+	struct stat sb;
+	UsageRecord *records;
+
+	if (usage_scores)
+		return 0;
+	if ((fd = open(file, O_RDONLY | O_CLOEXEC)) < 0)
+		return 0;
+	if (fstat(fd, &sb) != 0 || (count = sb.st_size / sizeof(UsageRecord)) == 0
+		|| (records = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return 0;
+	}
+	close(fd);
+
+	usage_scores = calloc(count, sizeof(UsageScore));
+	for (size_t i = 0; i < count; i++) {
+		age = now - records[i].time;
+		usage_scores[i].id = records[i].id;
+		usage_scores[i].score = age < 86400 ? 100 : age < 7 * 86400 ? 70
+			: age < 30 * 86400 ? 50 : age < 90 * 86400 ? 30 : 10;
+	}
+	munmap(records, sb.st_size);
+
+	/* merge the records of the same command */
+	qsort(usage_scores, count, sizeof(UsageScore), cmp_usage_score);
+	usage_count = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (usage_count > 0 && usage_scores[usage_count - 1].id == usage_scores[i].id)
+			usage_scores[usage_count - 1].score += usage_scores[i].score;
+		else
+			usage_scores[usage_count++] = usage_scores[i];
+	}
+	usage_scores = realloc(usage_scores, usage_count * sizeof(UsageScore));
+	mem_add(XDGMENU_MEM_USAGE, usage_count * sizeof(UsageScore));
+	return count;
+}
+
+/*
+ * Append a launch to the usage log, one fixed size record. When the log
+ * reaches USAGE_MAX records, only the last USAGE_KEEP are kept. Its folder
+ * is made by the refresh, call with usage_lock held.
+ */
+void usage_record(const char *file, const char *command)
+{
+	int fd;
+	char tmp_file[MLEN + 16] = {0};
+	UsageRecord record = {hash_str(command, strlen(command)), time(NULL)};
+	UsageRecord *records;
+	struct stat sb;
+
+	if ((fd = open(file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) < 0)
+		return;
+	if (fstat(fd, &sb) == 0 && sb.st_size >= USAGE_MAX * sizeof(UsageRecord)) {
+		close(fd);
+		records = malloc(USAGE_KEEP * sizeof(UsageRecord));
+		if ((fd = open(file, O_RDONLY | O_CLOEXEC)) < 0
+			|| pread(fd, records, USAGE_KEEP * sizeof(UsageRecord),
+					 sb.st_size - USAGE_KEEP * sizeof(UsageRecord))
+				!= USAGE_KEEP * sizeof(UsageRecord)) {
+			free(records);
+			if (fd >= 0)
+				close(fd);
+			return;
+		}
+		close(fd);
+		/* like cache_save, never leave a partially written log */
+		snprintf(tmp_file, sizeof(tmp_file), "%s.%d", file, getpid());
+		if ((fd = open(tmp_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) >= 0) {
+			if (!write_all(fd, (char *)records, USAGE_KEEP * sizeof(UsageRecord))
+				|| rename(tmp_file, file) != 0) {
+				unlink(tmp_file);
+				close(fd);
+				fd = -1;
+			}
+		}
+		free(records);
+		if (fd < 0)
+			return;
+		debug_msg("Usage log compacted\n");
+	}
+	write_all(fd, (char *)&record, sizeof(record));
+	close(fd);
+}
+
+int usage_score(const char *command, size_t len)
+{
+	UsageScore key = {hash_str(command, len)}, *match;
+
+	match = bsearch(&key, usage_scores, usage_count, sizeof(UsageScore), cmp_usage_score);
+	return match ? match->score : 0;
+}
+
+int write_all(int fd, const char *buffer, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, buffer, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		buffer += n;
+		len -= n;
+	}
+	return 1;
+}
+
+/* Free a context, a refresh must not run on it */
+void xdgmenu_ctx_free(xdgmenu_ctx *ctx)
+{
+	if (!ctx)
+		return;
+	pthread_mutex_destroy(&ctx->lock);
+	ctx_drop(ctx);
+	mem_add(XDGMENU_MEM_MENUS, -(ssize_t)ctx->launch_table.size);
+	free(ctx->launch_table.data);
+	hash_free(&ctx->commands);
+	free(ctx->launched.data);
+	free(ctx);
+}
+
+/* Record the command for -f and start it */
+void xdgmenu_ctx_launch(xdgmenu_ctx *ctx, const char *command)
+{
+	pthread_mutex_lock(&ctx->lock);
+	if (ctx->option.frecency && ctx->usage_file[0]) {
+		pthread_mutex_lock(&usage_lock);
+		usage_record(ctx->usage_file, command);
+		pthread_mutex_unlock(&usage_lock);
+	}
+	launch(command, &ctx->commands, &ctx->launched, ctx->option.debug);
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+/*
+ * Parse the options into a new context, the getopt state is reset first so
+ * that it can be called again. With -h or an invalid option the usage is
+ * printed and NULL returned.
+ */
+xdgmenu_ctx *xdgmenu_ctx_new(int argc, char *argv[])
 {
 	int opt;
+	struct Option opts = default_option;
+	xdgmenu_ctx *ctx;
 
-	while ((opt = getopt(argc, argv, "b:dDGhi:Ins:S:t:x:")) != -1) {
+	pthread_mutex_lock(&run_lock);
+	optind = 1;
+	while ((opt = getopt(argc, argv, "ab:cCdDfGhi:Ij:Lnp:q:rRs:S:t:TV:x:")) != -1) {
 		switch (opt) {
-			case 'b': option.fallback_icon = optarg; break;
-			case 'd': option.dump = 1; break;
-			case 'D': option.debug = 1; break;
-			case 'G': option.no_genname = 1; break;
-			case 'i': option.icon_theme = optarg; break;
-			case 'I': option.no_icon = 1; break;
-			case 'n': option.dry_run = 1; break;
-			case 's': option.icon_size = atoi(optarg); break;
-			case 'S': option.scale = atoi(optarg); break;
-			case 't': option.terminal = optarg; break;
-			case 'x': option.xmenu_cmd = optarg; break;
-			case 'h': default: puts(usage_str); exit(0); break;
+			case 'a': opts.actions = 1; break;
+			case 'b': opts.fallback_icon = optarg; break;
+			case 'c': opts.client = 1; break;
+			case 'C': opts.no_cache = 1; break;
+			case 'd': opts.dump = 1; break;
+			case 'D': opts.debug = 1; break;
+			case 'f': opts.frecency = 1; break;
+			case 'G': opts.no_genname = 1; break;
+			case 'i': opts.icon_theme = optarg; break;
+			case 'I': opts.no_icon = 1; break;
+			case 'j': opts.jobs = atoi(optarg); break;
+			case 'L': opts.low_memory = 1; break;
+			case 'n': opts.dry_run = 1; break;
+			case 'p': opts.pipe_size = atoi(optarg); break;
+			case 'q': opts.query = optarg; break;
+			case 'r': opts.daemon = 1; break;
+			case 'R': opts.rasterize = 1; break;
+			case 's': opts.icon_size = atoi(optarg); break;
+			case 'S': opts.scale = atoi(optarg); break;
+			case 't': opts.terminal = optarg; break;
+			case 'T': opts.timing = 1; break;
+			case 'V': opts.variants = optarg; break;
+			case 'x': opts.xmenu_cmd = optarg; break;
+			case 'h': default:
+				puts(usage_str);
+				pthread_mutex_unlock(&run_lock);
+				return NULL;
 		}
 	}
 
-#ifdef DEBUG
-	for (int i = 0; i < 1000; i++) {
-#endif
+	ctx = calloc(1, sizeof(xdgmenu_ctx));
+	ctx->option = opts;
+	ctx->xmenu_argc = argc - optind;
+	ctx->xmenu_argv = argv + optind;
+	pthread_mutex_init(&ctx->lock, NULL);
+	pthread_mutex_unlock(&run_lock);
+	return ctx;
+}
+
+/*
+ * Generate the menu of a context, or read it from the cache or the daemon,
+ * all the memory of the run is released before it returns. Only the new
+ * menu and its working directories are kept, swapped in at the end.
+ */
+int xdgmenu_ctx_refresh(xdgmenu_ctx *ctx)
+{
+	int hit = 0, changed;
+	char *fingerprint = NULL, *menu = NULL, usage_file[MLEN];
+	size_t flen = 0, mlen = 0, search_len;
+	uint32_t hash;
+	Buffer table = {0};
+	HashTable commands = {.kind = XDGMENU_MEM_MENUS};
+	FILE *fp;
+
+	pthread_mutex_lock(&run_lock);
+	option = ctx->option;
 	prepare_envvars();
+	timing_stage("prepare_envvars");
 	set_icon_theme();
-	if (!option.no_icon) {
+	timing_stage("set_icon_theme");
+	/* renders and launches use the usage log without run_lock */
+	snprintf(usage_file, MLEN, "%s", option.frecency && make_cache_dir() ? USAGE_FILE : "");
+
+	fp = open_memstream(&menu, &mlen);
+	if (option.client) {
+		hit = client_load(fp);
+		timing_stage("client_load");
+	}
+	/* needed by the fingerprint, and cheap with the theme cache */
+	if (!hit && !option.no_icon) {
 		find_icon_dirs();
-		find_icon(FALLBACK_ICON_PATH, option.fallback_icon);
+		timing_stage("find_icon_dirs");
 	}
-	find_all_apps();
+	if (!hit && !option.no_cache) {
+		FILE *fp_fingerprint = open_memstream(&fingerprint, &flen);
+		cache_fingerprint(fp_fingerprint);
+		fclose(fp_fingerprint);
+		hit = cache_load(fp, fingerprint, flen);
+		timing_stage("cache_load");
+	}
+	if (!hit) {
+		if (!option.no_icon) {
+			index_icons();
+			find_icon(FALLBACK_ICON_PATH, option.fallback_icon);
+			timing_stage("index_icons");
+		}
+		find_all_apps();
+		timing_stage("find_all_apps");
+		if (option.rasterize && !option.no_icon) {
+			rasterize_icons();
+			timing_stage("rasterize_icons");
+		}
+		xmenu_dump(fp);
+	}
+	fclose(fp);
+	if (!hit && !option.no_cache)
+		cache_save(fingerprint, flen, menu, mlen);
+	timing_stage(hit ? "read" : "dump");
+	search_len = menu_split(menu, &mlen, &table, &commands);
+	/* the records were copied to table */
+	menu = realloc(menu, mlen + 1 + search_len);
+	mem_add(XDGMENU_MEM_MENUS, mlen + 1 + search_len + table.size);
+
+	free(fingerprint);
+	clean_up_lists();
+	pthread_mutex_unlock(&run_lock);
 
-	if (option.dump)
-		xmenu_dump(stdout);
+	hash = ctx->option.low_memory ? hash_str(menu, mlen) : 0;
+	pthread_mutex_lock(&ctx->lock);
+	if (ctx->menu)
+		changed = mlen != ctx->menu_len || memcmp(menu, ctx->menu, mlen) != 0;
 	else
-		xmenu_run(argc - optind, argv + optind);
+		changed = !ctx->option.low_memory || hash != ctx->menu_hash || !ctx->launch_table.data;
+	ctx_drop(ctx);
+	mem_add(XDGMENU_MEM_MENUS, -(ssize_t)ctx->launch_table.size);
+	free(ctx->launch_table.data);
+	hash_free(&ctx->commands);
+	ctx->menu = menu;
+	ctx->menu_len = mlen;
+	ctx->menu_hash = hash;
+	ctx->launch_table = table;
+	ctx->commands = commands;
+	ctx->search = search_len > 0 ? menu + mlen + 1 : NULL;
+	ctx->search_len = search_len;
+	memcpy(ctx->usage_file, usage_file, MLEN);
+	pthread_mutex_unlock(&ctx->lock);
+	return changed;
+}
 
-	clean_up_lists();
+/*
+ * Copy the menu of the last refresh, the usage log is read again for -f.
+ * Only the globals of the usage are used, so a refresh does not block it.
+ */
+size_t xdgmenu_ctx_render(xdgmenu_ctx *ctx, char **menu)
+{
+	char usage_file[MLEN];
+	size_t len, records;
+
+	ctx_reload(ctx);
+	pthread_mutex_lock(&ctx->lock);
+	len = ctx->menu_len;
+	*menu = malloc(len + 1);
+	if (len > 0)
+		memcpy(*menu, ctx->menu, len);
+	(*menu)[len] = '\0';
+	memcpy(usage_file, ctx->usage_file, MLEN);
+	if (ctx->option.low_memory)
+		ctx_drop(ctx);
+	pthread_mutex_unlock(&ctx->lock);
+
+	if (ctx->option.frecency) {
+		pthread_mutex_lock(&usage_lock);
+		records = usage_file[0] ? usage_load(usage_file) : 0;
+		/* not debug_msg, option belongs to the refresh */
+		if (ctx->option.debug)
+			fprintf(stderr, "DEBUG: Usage log: %zu records of %zu commands\n",
+					records, usage_count);
+		frecency_sort(menu, &len);
+		usage_free();
+		pthread_mutex_unlock(&usage_lock);
+	}
+	return len;
+}
+
+/* Copy the menu lines of the apps matching query, see search_menu */
+size_t xdgmenu_ctx_search(xdgmenu_ctx *ctx, const char *query, char **menu)
+{
+	Buffer results = {0};
+
+	ctx_reload(ctx);
+	pthread_mutex_lock(&ctx->lock);
+	if (ctx->search)
+		search_menu(ctx->search, ctx->search_len, ctx->menu, ctx->menu_len, query, &results);
+	if (ctx->option.low_memory)
+		ctx_drop(ctx);
+	pthread_mutex_unlock(&ctx->lock);
+	buffer_append(&results, "", 1);
+	*menu = results.data;
+	return results.len - 1;
+}
+
+/* Start xmenu, render the menu for it while it starts up, and launch the choice */
+void xdgmenu_ctx_show(xdgmenu_ctx *ctx)
+{
+	int pid, fd_input = -1, fd_output = -1;
+	char *menu, *choice;
+	size_t len;
+
+	pthread_mutex_lock(&run_lock);
+	option = ctx->option;
+	pid = xmenu_start(ctx->xmenu_argc, ctx->xmenu_argv, &fd_input, &fd_output);
+	pthread_mutex_unlock(&run_lock);
+	if (ctx->option.query)
+		len = xdgmenu_ctx_search(ctx, ctx->option.query, &menu);
+	else
+		len = xdgmenu_ctx_render(ctx, &menu);
+	if ((choice = xmenu_run(pid, fd_input, fd_output, menu, len)) != NULL) {
+		if (ctx->option.dry_run)
+			puts(choice);
+		else
+			xdgmenu_ctx_launch(ctx, choice);
+	}
+	free(choice);
+	free(menu);
+}
+
+void xdgmenu_memory_stats(xdgmenu_memory *stats)
+{
+	for (int i = 0; i < XDGMENU_MEM_KINDS; i++) {
+		stats->used[i] = __atomic_load_n(&memory.used[i], __ATOMIC_RELAXED);
+		stats->peak[i] = __atomic_load_n(&memory.peak[i], __ATOMIC_RELAXED);
+	}
+	stats->used_total = __atomic_load_n(&memory.used_total, __ATOMIC_RELAXED);
+	stats->peak_total = __atomic_load_n(&memory.peak_total, __ATOMIC_RELAXED);
+	stats->leaked = memory.leaked;
+}
+
+int xdgmenu(int argc, char *argv[])
+{
+	int pid = -1, fd_input = -1, fd_output = -1, ret = 0;
+	char *menu, *choice;
+	size_t len;
+	xdgmenu_ctx *ctx;
+
+	if ((ctx = xdgmenu_ctx_new(argc, argv)) == NULL)
+		return 0;
+	option = ctx->option;
+
+#ifdef DEBUG
+	for (int i = 0; i < 1000; i++) {
+#endif
+	timing_stage(NULL);
+	if (option.daemon || option.variants) {
+		prepare_envvars();
+		timing_stage("prepare_envvars");
+		set_icon_theme();
+		timing_stage("set_icon_theme");
+		if (option.daemon) {
+			ret = strlen(XDG_RUNTIME_DIR) > 0 || make_cache_dir() ? daemon_run() : 1;
+		} else {
+			xmenu_variants();
+			timing_summary();
+		}
+		clean_up_lists();
+		xdgmenu_ctx_free(ctx);
+		return ret;
+	}
+
+	/* xmenu starts up while the menu is generated */
+	if (!option.dump) {
+		pid = xmenu_start(ctx->xmenu_argc, ctx->xmenu_argv, &fd_input, &fd_output);
+		timing_stage("xmenu_start");
+	}
+	xdgmenu_ctx_refresh(ctx);
+	if (option.query)
+		len = xdgmenu_ctx_search(ctx, option.query, &menu);
+	else
+		len = xdgmenu_ctx_render(ctx, &menu);
+	if (option.frecency && !option.query)
+		timing_stage("frecency_sort");
+	if (option.dump) {
+		fwrite(menu, 1, len, stdout);
+	} else if ((choice = xmenu_run(pid, fd_input, fd_output, menu, len)) != NULL) {
+		if (option.dry_run)
+			puts(choice);
+		else
+			xdgmenu_ctx_launch(ctx, choice);
+		free(choice);
+	}
+	timing_stage(option.dump ? "output" : "xmenu");
+	timing_summary();
+	free(menu);
 #ifdef DEBUG
 	}
 #endif
+	xdgmenu_ctx_free(ctx);
 	return 0;
 }
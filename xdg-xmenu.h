@@ -0,0 +1,62 @@
+/*
+ * Library interface of xdg-xmenu, for programs that keep the menu around,
+ * like xapps. A context holds the options it was created with and the last
+ * generated menu:
+ *
+ *	xdgmenu_ctx *ctx = xdgmenu_ctx_new(argc, argv);
+ *	xdgmenu_ctx_refresh(ctx);          any thread, e.g. in the background
+ *	len = xdgmenu_ctx_render(ctx, &menu);
+ *	len = xdgmenu_ctx_search(ctx, "text ed", &matches);
+ *	xdgmenu_ctx_launch(ctx, command);  a command of the menu
+ *	xdgmenu_ctx_free(ctx);
+ *
+ * Refreshes of all contexts run one at a time, rendering, searching and
+ * launching only wait for a refresh to swap in its menu. With -f, renders
+ * and launches of all contexts also take turns at the usage log. The
+ * strings of argv are used as is, they must stay valid until the context
+ * is freed. With -L, a context
+ * drops its menu once it is rendered, the next render refreshes it first.
+ */
+
+#ifndef XDG_XMENU_H
+#define XDG_XMENU_H
+
+#include <stddef.h>
+
+typedef struct xdgmenu_ctx xdgmenu_ctx;
+
+/* subsystems of the memory accounting */
+enum {
+	XDGMENU_MEM_APPS, XDGMENU_MEM_LISTS, XDGMENU_MEM_STRINGS, XDGMENU_MEM_ICONS,
+	XDGMENU_MEM_CACHES, XDGMENU_MEM_USAGE, XDGMENU_MEM_MENUS, XDGMENU_MEM_KINDS
+};
+
+/* bytes allocated by all contexts since the program started, see xdgmenu_memory_stats */
+typedef struct xdgmenu_memory {
+	size_t used[XDGMENU_MEM_KINDS];  /* in use now */
+	size_t peak[XDGMENU_MEM_KINDS];  /* the most in use so far */
+	size_t used_total;
+	size_t peak_total;               /* the most in use at once */
+	size_t leaked;                   /* left over by the last cleanup of a run, 0 but for a bug */
+} xdgmenu_memory;
+
+/* Parse the command line options, NULL with -h or an invalid option */
+xdgmenu_ctx *xdgmenu_ctx_new(int argc, char *argv[]);
+/* Generate the menu, or get it from the cache or the daemon. Returns 1 if it changed */
+int    xdgmenu_ctx_refresh(xdgmenu_ctx *ctx);
+/* Copy the last menu to a string to free, sorted by usage with -f. Returns its length */
+size_t xdgmenu_ctx_render(xdgmenu_ctx *ctx, char **menu);
+/* Copy the menu lines of the apps matching all words of query to a string to free, best first */
+size_t xdgmenu_ctx_search(xdgmenu_ctx *ctx, const char *query, char **menu);
+/* Start a command of the menu in the directory of its app */
+void   xdgmenu_ctx_launch(xdgmenu_ctx *ctx, const char *command);
+/* Show the last menu in xmenu and launch the chosen app, returns when xmenu exits */
+void   xdgmenu_ctx_show(xdgmenu_ctx *ctx);
+void   xdgmenu_ctx_free(xdgmenu_ctx *ctx);
+/* Copy the memory accounting, the menus are the only memory a context keeps between runs */
+void   xdgmenu_memory_stats(xdgmenu_memory *memory);
+
+/* The xdg-xmenu command */
+int    xdgmenu(int argc, char *argv[]);
+
+#endif